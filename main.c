@@ -12,6 +12,7 @@
  ・シミュレーション方法（モンテカルロ・シミュレーションか，需要全出しか）
  ・ファイル名
  ・計算する時間割引率（1だけか，3パターン全部やるか）
+ ・並列計算するなら-fopenmpを付けてコンパイルする（例：gcc -O2 -fopenmp main.c -lm）．付けなければ逐次計算
 */
 
 /*インプットは以下の通り
@@ -21,6 +22,9 @@
  ・in_network2（需要側のネットワークデータ）
  ・out_simulation（シミュレーション結果を格納するためのファイル）
  ・out_revenue（収益を格納するためのファイル）
+ ・out_reference（単精度の検証用に倍精度での結果を格納するファイル．PRECISION_CHECKが1のときのみ）
+ ・out_telemetry（方策反復・価値反復の経過を格納するファイル．TELEMETRYが1のときのみ）
+ ・checkpoint_trans，checkpoint（チェックポイントのファイル．CHECKPOINT_SECが0でないとき・RESUMEが1のときのみ）
  ※（アドホック対応）デマンドの滞在リンクは必ず用意．需要側の滞在リンクに対して(demand[j].o / 10) * 1000 + (demand[j].o % 10) * 10で対応するように設定する．
 */
 
@@ -31,6 +35,9 @@
 #include <math.h>
 #include <float.h>
 #include <unistd.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #define TRIALS 1000 //シミュレーションの回数
 #define RESULT_OUT 0 //車両の動き等の結果をCSVで出力するか否か
@@ -39,9 +46,17 @@
 #define SOLUTION 0 //後ろ向き帰納法…0，方策反復法…1，価値反復法…2
 #define V_INITIAL 0 //方策反復法で使用する状態価値関数の初期値
 #define MICRO 0.0001 //方策反復・価値反復の収束判定値
+#define PI_SWEEPS 0 //方策反復法の1回の方策評価のスイープ数の上限（修正方策反復法）．0なら収束するまで
+#define PI_SOLVER 0 //方策評価の方法：スイープのみ…0，BiCGSTABで解いてからスイープ…1，時刻の逆順に1回で厳密に求める…2
+#define BICG_MAXITER 1000 //BiCGSTABの最大反復回数
+#define VI_MODE 0 //価値反復法の更新順：配列番号順…0，時刻の逆順（ガウス・ザイデル）…1，優先度付きスイープ…2
 #define gamma_a 0.0 //時間割引率その1
 #define gamma_b 0.5 //時間割引率その2
 #define gamma_c 1.0 //時間割引率その3
+#define GAMMAS 3 //時間割引率のケース数
+#define CASE_BEGIN 2 //計算する最初のケース
+#define CASE_END 3 //計算する最後のケース+1
+#define FUSED_GAMMA 0 //後ろ向き帰納法のとき，全ケースをまとめて1回で計算するか
 #define b_service 1.5 //デマンド交通の効用の定数項
 #define Tmax 8 //終端時刻
 #define STEPTIME 5 //1タイムステップの時間（分）
@@ -51,6 +66,22 @@
 #define beta 1 //gRLの時間割引率
 #define PI 3.141592654 //円周率
 #define DENO 100 //強制終了対策
+#define THREADS 0 //並列計算（入札確率の需要ごと・後ろ向き帰納法の時刻ごとの状態）のスレッド数．0なら全コア（-fopenmpを付けてコンパイルしたときのみ有効）
+#define KEYWORDS 2 //状態のキーの語数（64ビット単位）
+#define LINKBITS 16 //状態のキー中のリンクの配列番号のビット数（64の約数）
+#define CHECKPOINT_SEC 0 //方策反復・価値反復のチェックポイントを書き出す間隔（秒）．0なら書き出さない
+#define RESUME 0 //チェックポイント（状態遷移確率・方策反復/価値反復の途中結果）から再開するか
+#define TELEMETRY 0 //方策反復・価値反復の繰り返しごとの経過（残差・方策の変化・時間）をCSVで書き出すか
+#define FLOAT_PROB 0 //状態遷移確率を単精度で格納するか（期待値の計算は倍精度）
+#define PRECISION_CHECK 0 //単精度の検証．FLOAT_PROBが0なら倍精度での結果を書き出し，1ならそれと比較する
+#define WAIT_CONSTS 2 //入札確率の表に持つ待ちリンクの効用の定数項の数（b_serviceあり・なし）
+#define GRL_LANES 4 //gRLを同時に解く需要の数（出発地・目的地リンクとデマンド交通リンク・待ちリンクの本数が同じ需要をまとめる）
+
+#if FLOAT_PROB
+typedef float Prob; //状態遷移確率の型
+#else
+typedef double Prob; //状態遷移確率の型
+#endif
 
 typedef struct network {
     int id;
@@ -79,20 +110,19 @@ typedef struct demand {
     double beta_fare; //運賃に対するパラメータ
     double beta_t; //時刻に対するパラメータ
     double beta_exp; //過去の経験を表すパラメータ
+    int onum; //デマンド交通側の出発地リンクの配列番号
+    int dnum; //デマンド交通側の目的地リンクの配列番号
     struct demand *next;
 } Demand;
 
-typedef struct {
-    Network link; //どこのリンクにいるか
-    unsigned short *sf; //入札状況
-} V_State; //車両の状態
-
 typedef struct {
     unsigned t; //時刻
-    V_State *vs;
+    unsigned long long key[KEYWORDS]; //車両ごとのリンクの配列番号（LINKBITSビットずつ）と，需要・車両ごとの入札状況（2ビットずつ）を詰めたもの
     unsigned short presence; //その状態が可能かどうか
     double V; //状態価値関数
-    unsigned long long id; //比較演算用
+    unsigned long long id; //時刻t内での通し番号（状態の探索用）
+    unsigned long long firstaction; //この状態の最初の行動の配列番号
+    unsigned long long numaction; //この状態の行動数
 } State; //状態
 
 typedef struct {
@@ -115,6 +145,103 @@ typedef struct {
     unsigned long long actionnum;
 } Policy; //最適方策
 
+typedef struct {
+    unsigned long long *offset; //行動ごとの遷移先の開始位置（要素数は行動数+1）
+    unsigned long long *statenum; //遷移先の状態の配列番号
+    Prob *prob; //遷移確率
+    unsigned long long nnz; //非ゼロ要素数
+    unsigned long long size; //statenum・probの確保済み要素数
+} Trans; //状態遷移確率（CSR形式）
+
+typedef struct {
+    int *offset; //リンクごとの接続先の開始位置（要素数はリンク数+1）
+    int *next; //接続先のリンクの配列番号（配列番号の小さい順）
+    int *order; //作成時の作業領域
+    int size_n; //offset・orderの確保済みのリンク数
+    int size_m; //nextの確保済みの要素数
+} Adjacency; //リンクの接続関係（CSR形式．作り直すときは確保済みの領域を使い回す）
+
+typedef struct {
+    Network *link3; //需要ごとのネットワーク（同時に解く需要の分を順に並べる）
+    Adjacency adj3; //link3の接続関係（同時に解く需要で共通）
+    Adjacency radj3; //link3の逆向きの接続関係
+    double *q; //遷移先リンクごとの(v + βV) / μ（とれないリンクは-DBL_MAX．同時に解く需要を内側に並べる）
+    int *dist; //幅優先探索の最小所要時間
+    int *queue; //幅優先探索の待ち行列
+    int n; //確保済みのリンク数
+} Grl_Work; //gRLの作業領域（スレッドごとに1つ確保し，全ての呼び出しで使い回す）
+
+typedef struct {
+    Network *base; //需要ごとの需要側リンクの複製（即時効用を格納済み・[需要][リンク]）
+    Adjacency adj; //需要側リンクの接続関係（adj.orderは起点ノード順の組）
+    int *dorder; //(終点ノード, 配列番号)の組を終点ノード順に並べたもの
+    int *onum; //需要ごとの出発地リンクの配列番号
+    int *dnum; //需要ごとの目的地ダミーリンクの配列番号
+    int *num1; //需要ごとのデマンド交通リンクの本数
+    int *maxnum2; //需要ごとの待ちリンクの本数の最大値
+    int *bidstart; //需要ごとの入札確率の表の開始位置
+    double *bid; //入札確率の表（[需要][待ちリンクの本数 - 1][定数項あり・なし]）
+    int n1; //需要側のリンク数
+    int n2; //需要数
+} Grl_Net; //gRLの需要側ネットワーク（需要ごとに変わらない部分を前計算したもの）
+
+typedef struct {
+    unsigned long long *node; //ヒープ（状態の配列番号）
+    unsigned long long *pos; //状態ごとのヒープ内の位置（ヒープにない状態はULLONG_MAX）
+    double *key; //状態ごとの優先度（ベルマン残差）
+    unsigned long long size; //ヒープの要素数
+} Heap; //優先度付きスイープの優先度つき待ち行列（最大ヒープ）
+
+typedef struct {
+    FILE *fp; //書き出し先（書き出さないならNULL）
+    char *solver; //解法の名前
+    double start; //計算開始時刻
+    double last; //前回書き出した時刻
+} Telemetry; //反復計算の経過の書き出し
+
+typedef struct {
+    int tmax; //Tmax
+    int vnumber; //VNUMBER
+    int capacity; //CAPACITY
+    int float_prob; //FLOAT_PROB
+    unsigned long long hash; //入力データ（model_hash）と状態の時刻・キー・行動数のハッシュ
+} Ckpt_Header; //チェックポイントのヘッダ（一致しなければそのファイルは使わない）
+
+/*状態のキー中の車両iのリンクの配列番号の位置（ビット）*/
+#define LINK_POS(i) (LINKBITS * (i))
+/*状態のキー中の車両i・需要kの入札状況の位置（ビット）*/
+#define SF_POS(i, k) (LINKBITS * VNUMBER + 2 * (VNUMBER * (k) + (i)))
+
+/*車両iのリンクの配列番号を返す*/
+int get_link(State *state, int i)
+{
+    return (int)((state->key[LINK_POS(i) / 64] >> (LINK_POS(i) % 64)) & ((1ULL << LINKBITS) - 1));
+}
+
+/*車両iのリンクの配列番号を格納する*/
+void set_link(State *state, int i, int num)
+{
+    state->key[LINK_POS(i) / 64] &= ~(((1ULL << LINKBITS) - 1) << (LINK_POS(i) % 64));
+    state->key[LINK_POS(i) / 64] |= (unsigned long long)num << (LINK_POS(i) % 64);
+
+    return;
+}
+
+/*車両i・需要kの入札状況を返す*/
+unsigned short get_sf(State *state, int i, int k)
+{
+    return (unsigned short)((state->key[SF_POS(i, k) / 64] >> (SF_POS(i, k) % 64)) & 3);
+}
+
+/*車両i・需要kの入札状況を格納する*/
+void set_sf(State *state, int i, int k, unsigned short sf)
+{
+    state->key[SF_POS(i, k) / 64] &= ~(3ULL << (SF_POS(i, k) % 64));
+    state->key[SF_POS(i, k) / 64] |= (unsigned long long)sf << (SF_POS(i, k) % 64);
+
+    return;
+}
+
 /*デマンド交通のネットワークデータの仮格納*/
 Network *input_network(Network *linklist, char *in_network, int *number_of_links)
 {
@@ -295,27 +422,167 @@ void set_demand(Demand *demand, Demand *odlist, char *in_od, int n)
     return;
 }
 
-/*状態数の計算*/
+/*需要ごとにデマンド交通側の出発地・目的地リンクの配列番号を求める*/
+void set_demand_link(Demand *demand, int n1, Network *link, int n2)
+{
+    int i, k;
+
+    for (k = 0; k < n1; k++) {
+        demand[k].onum = -1;
+        demand[k].dnum = -1;
+        for (i = 0; i < n2; i++) {
+            if (link[i].id == (demand[k].o / 10) * 1000 + (demand[k].o % 10) * 10) { //アドホック
+                demand[k].onum = i; //O^L_kの配列番号の探索
+            }
+            if (link[i].id == (demand[k].d / 10) * 1000 + (demand[k].d % 10) * 10) { //アドホック
+                demand[k].dnum = i;
+            }
+        }
+        if (demand[k].onum == -1 || demand[k].dnum == -1) {
+            puts("onumまたはdnumが見つかりませんでした．");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    return;
+}
+
+/*時刻tにおける需要1つ分のsf_iktの組み合わせ数（混合基数の基数）*/
+unsigned long long sf_radix(unsigned t, Demand demand)
+{
+    if ((int)t <= (int)demand.tb - 2) {
+        return 1;
+    } else if (t == demand.tb - 1) {
+        return 2;
+    } else if (t == demand.tb) {
+        return VNUMBER + 1;
+    } else {
+        return 2 * VNUMBER + 1;
+    }
+}
+
+/*時刻tに需要の桁がdigitのとき乗車中（sf = 3）になる車両番号を返す．乗車中の車両がなければ-1*/
+int onboard_vehicle(unsigned t, Demand demand, unsigned long long digit)
+{
+    if (sf_radix(t, demand) == 2 * VNUMBER + 1 && digit > VNUMBER) {
+        return (int)(digit - VNUMBER - 1);
+    }
+
+    return -1;
+}
+
+/*時刻tに列挙する状態の容量（n人まで乗れれば制限なし）*/
+/*終端時刻の状態は行動をとらず状態価値も0なので，容量を超える状態も残して遷移先にできるようにする（容量超過を制約違反とするのはt < Tmaxのみ）*/
+int layer_capacity(unsigned t, int n)
+{
+    if (t == Tmax) {
+        return n;
+    }
+
+    return (CAPACITY < n) ? CAPACITY : n;
+}
+
+/*時刻tにおいて容量制約を満たすsf_iktの組み合わせ数*/
+unsigned long long how_many_sf(unsigned t, Demand *demand, int n)
+{
+    int i, k, v;
+    int cap; //実質的な容量（OD数より大きくても意味がない）
+    unsigned long long c, NC, digit, total;
+    unsigned long long pw[VNUMBER]; //乗車人数の組み合わせの各車両の桁の重み
+    unsigned long long *cnt, *tmp, *swap;
+
+    cap = layer_capacity(t, n);
+    NC = 1;
+    for (i = 0; i < VNUMBER; i++) {
+        pw[i] = NC;
+        NC *= (cap + 1);
+    }
+
+    /*cnt[c]は需要kまで決めたときに各車両の乗車人数の組み合わせがcとなる場合の数*/
+    cnt = (unsigned long long *)calloc(NC, sizeof(unsigned long long));
+    tmp = (unsigned long long *)calloc(NC, sizeof(unsigned long long));
+    if (cnt == NULL || tmp == NULL) {
+        puts("状態数の計算用のメモリ確保に失敗しました．");
+        exit(EXIT_FAILURE);
+    }
+
+    cnt[0] = 1;
+    for (k = 0; k < n; k++) {
+        for (c = 0; c < NC; c++) {
+            tmp[c] = 0;
+        }
+        for (c = 0; c < NC; c++) {
+            if (cnt[c] == 0) {
+                continue;
+            }
+            for (digit = 0; digit < sf_radix(t, demand[k]); digit++) {
+                v = onboard_vehicle(t, demand[k], digit);
+                if (v == -1) {
+                    tmp[c] += cnt[c];
+                } else if ((c / pw[v]) % (cap + 1) < cap) {
+                    tmp[c + pw[v]] += cnt[c]; //車両vの乗車人数が1人増える
+                }
+            }
+        }
+        swap = cnt;
+        cnt = tmp;
+        tmp = swap;
+    }
+
+    total = 0;
+    for (c = 0; c < NC; c++) {
+        total += cnt[c];
+    }
+
+    free(cnt);
+    free(tmp);
+
+    return total;
+}
+
+/*容量制約を満たすsf_iktの次の組み合わせ（辞書順）にdigitを進める．loadは車両ごとの乗車人数．次がなければ0を返す*/
+int next_sf_digits(unsigned t, Demand *demand, int n, unsigned long long *digit, unsigned *load)
+{
+    int k, v;
+
+    for (k = n - 1; k >= 0; k--) {
+        v = onboard_vehicle(t, demand[k], digit[k]);
+        if (v != -1) {
+            load[v]--;
+        }
+
+        /*容量を超える桁は飛ばす*/
+        digit[k]++;
+        while (digit[k] < sf_radix(t, demand[k])) {
+            v = onboard_vehicle(t, demand[k], digit[k]);
+            if (v == -1 || load[v] < layer_capacity(t, n)) {
+                break;
+            }
+            digit[k]++;
+        }
+
+        if (digit[k] < sf_radix(t, demand[k])) {
+            if (v != -1) {
+                load[v]++;
+            }
+            return 1; //下の桁はすでに0（誰も乗車していない）
+        }
+        digit[k] = 0; //繰り上がり
+    }
+
+    return 0;
+}
+
+/*状態数の計算（容量制約を満たす状態のみ）*/
 unsigned long long how_many_states(Demand *demand, Network *link, int n, int m)
 {
-    int k, i;
+    int i;
     unsigned t;
     unsigned long long tmp1, tmp2, tmp3;
     
     tmp3 = 0;
     for (t = 0; t <= Tmax; t++) {
-        tmp1 = 1;
-        for (k = 0; k < n; k++) {
-            if ((int)t <= (int)demand[k].tb - 2) {
-                tmp1 *= 1;
-            } else if (t == demand[k].tb - 1) {
-                tmp1 *= 2;
-            } else if (t == demand[k].tb) {
-                tmp1 *= (VNUMBER + 1);
-            } else {
-                tmp1 *= (2 * VNUMBER + 1);
-            }
-        }
+        tmp1 = how_many_sf(t, demand, n); //容量制約を満たすsf_iktの組み合わせ数
         tmp2 = 1;
         for (i = 0; i < VNUMBER; i++) {
             tmp2 *= (unsigned long long)m;
@@ -329,58 +596,62 @@ unsigned long long how_many_states(Demand *demand, Network *link, int n, int m)
     return tmp3;
 }
 
-/*状態の格納*/
-void set_states(State *state, unsigned long long n1, Demand *demand, int n2, Network *link, int n3)
+/*状態の格納．状態は時刻ごとにまとめて並べ，時刻tの状態はlayer[t]番目からlayer[t + 1] - 1番目とする*/
+void set_states(State *state, unsigned long long n1, unsigned long long *layer, Demand *demand, int n2, Network *link, int n3)
 {
     int i, j, k, ii, kk;
     unsigned t;
-    unsigned long long N1, N2;
+    unsigned long long N2;
     unsigned long long k1, k2, K1, K2;
     unsigned long long count;
     unsigned long long deno;
-    unsigned num;
+    unsigned long long *digit; //需要ごとのsf_iktの桁
+    unsigned load[VNUMBER]; //車両ごとの乗車人数
+    
+    if (SF_POS(VNUMBER - 1, n2 - 1) + 2 > 64 * KEYWORDS || n3 > (1 << LINKBITS)) {
+        puts("状態のキーのビット数が足りません．KEYWORDSまたはLINKBITSを増やしてください．");
+        exit(EXIT_FAILURE);
+    }
+    
+    digit = (unsigned long long *)malloc(sizeof(unsigned long long) * n2);
+    if (digit == NULL) {
+        puts("状態の列挙用のメモリ確保に失敗しました．");
+        exit(EXIT_FAILURE);
+    }
     
     count = 0;
     for (t = 0; t <= Tmax; t++) {
-        N1 = 1;
-        for (k = 0; k < n2; k++) {
-            if ((int)t <= (int)demand[k].tb - 2) {
-                N1 *= 1;
-            } else if (t == demand[k].tb - 1) {
-                N1 *= 2;
-            } else if (t == demand[k].tb) {
-                N1 *= (VNUMBER + 1);
-            } else {
-                N1 *= (2 * VNUMBER + 1);
-            }
-        } // N1はsf_iktの組み合わせ数（t固定）
+        layer[t] = count; //時刻tの先頭の配列番号
         
         N2 = 1;
         for (i = 0; i < VNUMBER; i++) {
             N2 *= n3;
         } //N2はl_itの組み合わせ数（t固定）
         
-        for (k1 = 0; k1 < N1; k1++) {
+        /*容量制約を満たすsf_iktの組み合わせだけを辞書順に列挙*/
+        for (k = 0; k < n2; k++) {
+            digit[k] = 0;
+        }
+        for (i = 0; i < VNUMBER; i++) {
+            load[i] = 0;
+        }
+        do {
+            k1 = 0;
+            for (k = 0; k < n2; k++) {
+                k1 = k1 * sf_radix(t, demand[k]) + digit[k]; //混合基数での値
+            }
+            
             for (k2 = 0; k2 < N2; k2++) {
                 K1 = k1;
                 K2 = k2;
                 
-                state[count].vs = (V_State *)malloc(sizeof(V_State) * VNUMBER);
-                if (state[count].vs == NULL) {
-                    printf("state[%llu].vsのメモリ確保に失敗しました．\n", count);
-                    exit(EXIT_FAILURE);
-                }
-                for (j = 0; j < VNUMBER; j++) {
-                    state[count].vs[j].sf = (unsigned short *)malloc(sizeof(unsigned short) * n2);
-                    if (state[count].vs[j].sf == NULL) {
-                        printf("state[%llu].vs[%d].sfのメモリ確保に失敗しました．\n", count, j);
-                        exit(EXIT_FAILURE);
-                    }
+                for (j = 0; j < KEYWORDS; j++) {
+                    state[count].key[j] = 0;
                 }
                 
                 state[count].presence = 1;
                 state[count].t = t;
-                state[count].id = count;
+                state[count].id = k1 * N2 + k2; //時刻t内での通し番号（容量制約を除いた混合基数の値）
                 
                 /*l_itの格納*/
                 for (i = 0; i < VNUMBER; i++) {
@@ -394,7 +665,7 @@ void set_states(State *state, unsigned long long n1, Demand *demand, int n2, Net
                         printf("K2 / deno = %llu\n", K2 / deno);
                         exit(EXIT_FAILURE);
                     } else {
-                        state[count].vs[i].link = link[K2 / deno];
+                        set_link(&state[count], i, (int)(K2 / deno));
                     }
                     K2 %= deno;
                 }
@@ -416,16 +687,16 @@ void set_states(State *state, unsigned long long n1, Demand *demand, int n2, Net
                     
                     if ((int)t <= (int)demand[k].tb - 2) {
                         for (i = 0; i < VNUMBER; i++) {
-                            state[count].vs[i].sf[k] = 0;
+                            set_sf(&state[count], i, k, 0);
                         }
                     } else if (t == demand[k].tb - 1) {
                         if (K1 / deno == 0) {
                             for (i = 0; i < VNUMBER; i++) {
-                                state[count].vs[i].sf[k] = 0;
+                                set_sf(&state[count], i, k, 0);
                             }
                         } else if (K1 /deno == 1) {
                             for (i = 0; i < VNUMBER; i++) {
-                                state[count].vs[i].sf[k] = 1;
+                                set_sf(&state[count], i, k, 1);
                             }
                         } else {
                             puts("K1 / denoの値が不正です．");
@@ -435,7 +706,7 @@ void set_states(State *state, unsigned long long n1, Demand *demand, int n2, Net
                     } else if (t == demand[k].tb) {
                         if (K1 / deno == 0) {
                             for (i = 0; i < VNUMBER; i++) {
-                                state[count].vs[i].sf[k] = 0;
+                                set_sf(&state[count], i, k, 0);
                             }
                         } else if (K1 / deno > VNUMBER) {
                             puts("K1 / denoの値が不正です．");
@@ -444,16 +715,16 @@ void set_states(State *state, unsigned long long n1, Demand *demand, int n2, Net
                         } else {
                             for (i = 0; i < VNUMBER; i++) {
                                 if (i == K1 / deno - 1) {
-                                    state[count].vs[i].sf[k] = 2;
+                                    set_sf(&state[count], i, k, 2);
                                 } else {
-                                    state[count].vs[i].sf[k] = 0;
+                                    set_sf(&state[count], i, k, 0);
                                 }
                             }
                         }
                     } else {
                         if (K1 / deno == 0) {
                             for (i = 0; i < VNUMBER; i++) {
-                                state[count].vs[i].sf[k] = 0;
+                                set_sf(&state[count], i, k, 0);
                             }
                         } else if (K1 / deno > 2 * VNUMBER) {
                             puts("K1 / denoの値が不正です．");
@@ -462,17 +733,17 @@ void set_states(State *state, unsigned long long n1, Demand *demand, int n2, Net
                         } else if (K1 / deno >= 1 && K1 / deno <= VNUMBER) {
                             for (i = 0; i < VNUMBER; i++) {
                                 if (i == K1 / deno - 1) {
-                                    state[count].vs[i].sf[k] = 2;
+                                    set_sf(&state[count], i, k, 2);
                                 } else {
-                                    state[count].vs[i].sf[k] = 0;
+                                    set_sf(&state[count], i, k, 0);
                                 }
                             }
                         } else {
                             for (i = 0; i < VNUMBER; i++) {
                                 if (i == K1 / deno - VNUMBER - 1) {
-                                    state[count].vs[i].sf[k] = 3;
+                                    set_sf(&state[count], i, k, 3);
                                 } else {
-                                    state[count].vs[i].sf[k] = 0;
+                                    set_sf(&state[count], i, k, 0);
                                 }
                             }
                         }
@@ -491,8 +762,9 @@ void set_states(State *state, unsigned long long n1, Demand *demand, int n2, Net
                 
                 count++;
             }
-        }
+        } while (next_sf_digits(t, demand, n2, digit, load));
     }
+    layer[Tmax + 1] = count;
   
     if (count != n1) {
         puts("状態数が間違っています．");
@@ -501,158 +773,318 @@ void set_states(State *state, unsigned long long n1, Demand *demand, int n2, Net
         exit(EXIT_FAILURE);
     }
     
-    count = 0;
-    for (j = 0; j < n1; j++) {
+    free(digit);
+    
+    puts("状態の格納完了");
+
+    return;
+}
+
+/*時刻t，各車両のリンクの配列番号linknum，入札状況sf（車両i・需要kはsf[n2 * i + k]）の状態の配列番号を返す*/
+/*set_statesと同じ混合基数の値を求め，時刻tの状態から二分探索する．存在しない（容量制約違反の）状態なら-1を返す*/
+unsigned long long get_state_number(unsigned t, int *linknum, unsigned short *sf, State *state, unsigned long long *layer, Demand *demand, int n2, int n3)
+{
+    int i, k;
+    unsigned long long N2, K1, K2, id;
+    unsigned long long digit;
+    unsigned long long lo, hi, mid;
+
+    N2 = 1;
+    for (i = 0; i < VNUMBER; i++) {
+        N2 *= n3;
+    }
+
+    /*sf_iktの桁*/
+    K1 = 0;
+    for (k = 0; k < n2; k++) {
+        digit = 0;
         for (i = 0; i < VNUMBER; i++) {
-            num = 0;
-            for (k = 0; k < n2; k++) {
-                if (state[j].vs[i].sf[k] == 3) {
-                    num++;
-                }
-            }
-            if (num > CAPACITY) {
-                state[j].presence = 0;
+            if (sf[n2 * i + k] == 1) {
+                digit = 1; //全車両で1
+                break;
+            } else if (sf[n2 * i + k] == 2) {
+                digit = i + 1;
+                break;
+            } else if (sf[n2 * i + k] == 3) {
+                digit = VNUMBER + i + 1;
                 break;
             }
         }
-        
-        if (state[j].presence) {
-            count++;
+        if (digit >= sf_radix(t, demand[k])) {
+            puts("遷移先の入札状況が不正です．");
+            printf("t = %u, k = %d, digit = %llu\n", t, k, digit);
+            exit(EXIT_FAILURE);
         }
+        K1 = K1 * sf_radix(t, demand[k]) + digit;
     }
-    
-    printf("可能な状態数：%llu\n", count);
-    puts("状態の格納完了");
 
-    return;
+    /*l_itの桁*/
+    K2 = 0;
+    for (i = 0; i < VNUMBER; i++) {
+        K2 = K2 * n3 + linknum[i];
+    }
+
+    id = K1 * N2 + K2;
+
+    /*idは時刻内で昇順に並んでいる*/
+    lo = layer[t];
+    hi = layer[t + 1];
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (state[mid].id < id) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == layer[t + 1] || state[lo].id != id) {
+        return -1;
+    }
+
+    return lo;
+}
+
+/*(ノード, 配列番号)の組の比較（隣接リストの作成用）*/
+int compare_node(const void *a, const void *b)
+{
+    const int *x = (const int *)a;
+    const int *y = (const int *)b;
+
+    if (x[0] != y[0]) {
+        return (x[0] < y[0]) ? -1 : 1;
+    }
+    return (x[1] < y[1]) ? -1 : (x[1] > y[1]);
 }
 
-/*Dijkstra法．startからgoalまでの最短所要時間を返す*/
-int dijkstra(int start, int goal, Network *link, int n) //prevは前回呼び出したときのn
+/*gRLの計算の組（出発地リンク，目的地リンク，デマンド交通リンクの本数，待ちリンクの本数，需要）の比較関数（qsort用）*/
+int compare_task(const void *a, const void *b)
 {
+    const int *x = (const int *)a;
+    const int *y = (const int *)b;
     int i;
-    int min, argmin;
-    int past;
-    int d[256], Q[256];
-    
-//    printf("%d\n", *prev);
-//    printf("%d\n", n);
-//
-//    if (*prev == -1) {
-//        puts("a");
-//        d = (int *)malloc(sizeof(int) * n);
-//        Q = (int *)malloc(sizeof(int) * n);
-//        if (d == NULL || Q == NULL) {
-//            puts("メモリ不足4.0");
-//            exit(EXIT_FAILURE);
-//        }
-//    } else if (n != *prev) {
-//        puts("b");
-//        d2 = (int *)realloc(d, sizeof(int) * n);
-//        Q2 = (int *)realloc(Q, sizeof(int) * n);
-//        if (d2 == NULL || Q2 == NULL) {
-//            puts("メモリ不足4.1");
-//            exit(EXIT_FAILURE);
-//        } else {
-//            d = d2;
-//            Q = Q2;
-//        }
-//    }
-    
-    /*初期化*/
-    for (i = 0; i < n; i++) {
-        Q[i] = 1;
-        
-        if (link[i].id == start) {
-            d[i] = 0;
+
+    for (i = 0; i < 5; i++) {
+        if (x[i] != y[i]) {
+            return (x[i] < y[i]) ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+/*ノード順に並べた組の中で，ノードがnode以上になる最初の位置を返す*/
+int lower_node(int *order, int n, int node)
+{
+    int lo = 0, hi = n, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (order[2 * mid] < node) {
+            lo = mid + 1;
         } else {
-            d[i] = INT_MAX;
+            hi = mid;
         }
     }
 
-    past = INT_MAX / 2;
-    /*本計算*/
-    while (1) {
-        min = INT_MAX;
-        argmin = n;
-        for (i = 0; i < n; i++) {
-            if (Q[i]) {
-                if (d[i] <= min) {
-                    min = d[i];
-                    argmin = i;
-                }
-            }
+    return lo;
+}
+
+/*接続関係の領域をリンク数n，接続するリンクの組の数m以上に拡張する*/
+void reserve_adjacency(Adjacency *adj, int n, int m)
+{
+    int *tmp_offset, *tmp_order, *tmp_next;
+
+    if (n > adj->size_n) {
+        tmp_offset = (int *)realloc(adj->offset, sizeof(int) * (n + 1));
+        tmp_order = (int *)realloc(adj->order, sizeof(int) * 2 * n);
+        if (tmp_offset == NULL || tmp_order == NULL) {
+            puts("メモリ不足4.1");
+            exit(EXIT_FAILURE);
         }
-        if (argmin == n) {
-            puts("Dijkstra法で最小コストのリンクが見つかりません．");
-            exit(0);
+        adj->offset = tmp_offset;
+        adj->order = tmp_order;
+        adj->size_n = n;
+    }
+    if (m > adj->size_m) {
+        tmp_next = (int *)realloc(adj->next, sizeof(int) * m);
+        if (tmp_next == NULL) {
+            puts("メモリ不足4.2");
+            exit(EXIT_FAILURE);
         }
-        
-        if (link[argmin].id == goal) {
-            break;
+        adj->next = tmp_next;
+        adj->size_m = m;
+    }
+
+    return;
+}
+
+/*リンクの接続関係の作成．link[i].d == link[j].oとなるjをリンクiの接続先とする*/
+void set_adjacency(Adjacency *adj, Network *link, int n)
+{
+    int i, m, e;
+    int *order; //(起点ノード, 配列番号)の組を起点ノード順に並べたもの
+
+    reserve_adjacency(adj, (n > 0) ? n : 1, 0);
+    order = adj->order;
+    for (i = 0; i < n; i++) {
+        order[2 * i] = link[i].o;
+        order[2 * i + 1] = i;
+    }
+    qsort(order, n, sizeof(int) * 2, compare_node);
+
+    /*接続先の数を数える*/
+    adj->offset[0] = 0;
+    for (i = 0; i < n; i++) {
+        e = 0;
+        for (m = lower_node(order, n, link[i].d); m < n && order[2 * m] == link[i].d; m++) {
+            e++;
         }
+        adj->offset[i + 1] = adj->offset[i] + e;
+    }
 
-        if (argmin == past) {
-            puts("Dijkstra法で繰り返し発生");
-            printf("argmin = %d\n", argmin);
-            printf("id = %d\n", link[argmin].id);
-            exit(0);
+    /*接続先を格納*/
+    reserve_adjacency(adj, n, adj->offset[n]);
+    for (i = 0; i < n; i++) {
+        e = adj->offset[i];
+        for (m = lower_node(order, n, link[i].d); m < n && order[2 * m] == link[i].d; m++) {
+            adj->next[e] = order[2 * m + 1];
+            e++;
         }
-        past = argmin;
-        Q[argmin] = 0;
+    }
 
-        for (i = 0; i < n; i++) {
-            if (link[argmin].d == link[i].o) {
-                if (d[i] > d[argmin] + 1) {
-                    d[i] = d[argmin] + 1;
-                }
+    return;
+}
+
+/*リンクの接続関係の解放*/
+void free_adjacency(Adjacency *adj)
+{
+    free(adj->offset);
+    free(adj->next);
+    free(adj->order);
+
+    return;
+}
+
+/*接続関係の向きを逆にする（リンクiに入ってくるリンクの一覧を作る）*/
+void set_reverse_adjacency(Adjacency *radj, Adjacency *adj, int n)
+{
+    int i, e;
+    int *pos; //リンクごとの次の格納位置
+
+    reserve_adjacency(radj, (n > 0) ? n : 1, adj->offset[n]);
+    pos = radj->order;
+    for (i = 0; i <= n; i++) {
+        radj->offset[i] = 0;
+    }
+    for (e = 0; e < adj->offset[n]; e++) {
+        radj->offset[adj->next[e] + 1]++;
+    }
+    for (i = 0; i < n; i++) {
+        radj->offset[i + 1] += radj->offset[i];
+        pos[i] = radj->offset[i];
+    }
+    for (i = 0; i < n; i++) {
+        for (e = adj->offset[i]; e < adj->offset[i + 1]; e++) {
+            radj->next[pos[adj->next[e]]] = i;
+            pos[adj->next[e]]++;
+        }
+    }
+
+    return;
+}
+
+/*幅優先探索．リンクstartから各リンクまでの最小所要時間（リンク数）をdistに格納する．到達できなければ-1*/
+void bfs(int start, Adjacency *adj, int n, int *dist, int *queue)
+{
+    int i, u, e;
+    int head, tail;
+
+    for (i = 0; i < n; i++) {
+        dist[i] = -1;
+    }
+    dist[start] = 0;
+    queue[0] = start;
+    head = 0;
+    tail = 1;
+    while (head < tail) {
+        u = queue[head];
+        head++;
+        for (e = adj->offset[u]; e < adj->offset[u + 1]; e++) {
+            if (dist[adj->next[e]] == -1) {
+                dist[adj->next[e]] = dist[u] + 1;
+                queue[tail] = adj->next[e];
+                tail++;
             }
         }
     }
 
-    return min;
+    return;
 }
 
-/*行動の制約条件としての指示関数Iの決定・事前に全て1で初期化が必要！*/
-void get_I_for_action(Network *link, int n1, Demand demand, int demandnum, V_State v_state, int t) //demandnumは配列の何番目か
+/*デマンド交通のリンク間の最小所要時間（リンク数）をhop[n * i + j]（iからjまで）に格納する．到達できなければ-1*/
+void set_hop(int *hop, Adjacency *adj, int n)
 {
     int i;
-    int onum = -1, dnum = -1;
-    
-    for (i = 0; i < n1; i++) {
-        if (link[i].id == (demand.o / 10) * 1000 + (demand.o % 10) * 10) { //アドホック
-            onum = i; //O^L_kの配列番号の探索
-        }
-        if (link[i].id == (demand.d / 10) * 1000 + (demand.d % 10) * 10) { //アドホック
-            dnum = i;
-        }
+    int *queue;
+
+    queue = (int *)malloc(sizeof(int) * (n > 0 ? n : 1));
+    if (queue == NULL) {
+        puts("メモリ不足4.3");
+        exit(EXIT_FAILURE);
     }
-    if (onum == -1 || dnum == -1) {
-        puts("onumまたはdnumが見つかりませんでした．");
+
+    /*始点ごとに幅優先探索（所要時間は全てのリンクで1）*/
+    for (i = 0; i < n; i++) {
+        bfs(i, adj, n, hop + n * i, queue);
+    }
+
+    free(queue);
+
+    printf("リンク間の最小所要時間の計算完了\n");
+
+    return;
+}
+
+/*リンクの配列番号fromからtoまでの最小所要時間を返す*/
+int get_hop(int *hop, int n, int from, int to)
+{
+    if (hop[n * from + to] < 0) {
+        puts("最小所要時間のリンクが見つかりません．");
         exit(EXIT_FAILURE);
     }
 
+    return hop[n * from + to];
+}
+
+/*行動の制約条件としての指示関数Iの決定・事前に全て1で初期化が必要！*/
+void get_I_for_action(Network *link, int n1, Demand demand, int demandnum, State *state, int vehicle, int *hop) //demandnumは配列の何番目か，vehicleは車両番号
+{
+    int i;
+    int t = state->t;
+    int lnum = get_link(state, vehicle); //車両が今いるリンクの配列番号
+    unsigned short sf = get_sf(state, vehicle, demandnum);
+    int onum = demand.onum, dnum = demand.dnum; //O^L_k・D^L_kの配列番号
+
     /*最小所要時間を求める*/
     for (i = 0; i < n1; i++) {
-        if (link[i].o == v_state.link.d) {
-            link[i].mincost_o = dijkstra(link[i].id, link[onum].id, link, n1); //そのリンクから需要のOまでの所要時間．
-            link[i].mincost_d = dijkstra(link[i].id, link[dnum].id, link, n1); //そのリンクから需要のDまでの所要時間．
+        if (link[i].o == link[lnum].d) {
+            link[i].mincost_o = get_hop(hop, n1, i, onum); //そのリンクから需要のOまでの所要時間．
+            link[i].mincost_d = get_hop(hop, n1, i, dnum); //そのリンクから需要のDまでの所要時間．
         }
     }
     
-    if (v_state.sf[demandnum] == 0 || v_state.sf[demandnum] == 1) {
+    if (sf == 0 || sf == 1) {
         for (i = 0; i < n1; i++) {
-            if (link[i].o != v_state.link.d) {
+            if (link[i].o != link[lnum].d) {
                 link[i].I = 0; //乗車していないなら空間的接続条件のみ
             }
         }
-    } else if (v_state.sf[demandnum] == 2) { //予約受理・未乗車の場合
+    } else if (sf == 2) { //予約受理・未乗車の場合
         for (i = 0; i < n1; i++) {
-            if (link[i].o != v_state.link.d) {
+            if (link[i].o != link[lnum].d) {
                 link[i].I = 0;
             } else {
                 if (link[i].o != link[onum].d) { //普通はこっち
-                    if (t + link[i].mincost_o + dijkstra(link[onum].id, link[dnum].id, link, n1) > demand.te) {
+                    if (t + link[i].mincost_o + get_hop(hop, n1, onum, dnum) > demand.te) {
                         link[i].I = 0; //出発地を通って目的地にたどり着く最小時間と比較
                     }
                 } else { //遷移先のリンクで乗車する場合は，目的地までの所要時間を考えれば良い
@@ -662,9 +1094,9 @@ void get_I_for_action(Network *link, int n1, Demand demand, int demandnum, V_Sta
                 }
             }
         }
-    } else if (v_state.sf[demandnum] == 3 && v_state.link.d != link[dnum].o) { //乗車中で，次の状態でも客が乗っている場合
+    } else if (sf == 3 && link[lnum].d != link[dnum].o) { //乗車中で，次の状態でも客が乗っている場合
         for (i = 0; i < n1; i++) {
-            if (link[i].o != v_state.link.d) {
+            if (link[i].o != link[lnum].d) {
                 link[i].I = 0;
             } else {
                 if (link[i].mincost_d + t > demand.te - 1) {
@@ -674,7 +1106,7 @@ void get_I_for_action(Network *link, int n1, Demand demand, int demandnum, V_Sta
         }
     } else { //乗車中だが，次の状態では客が乗っていない場合
         for (i = 0; i < n1; i++) {
-            if (link[i].o != v_state.link.d) {
+            if (link[i].o != link[lnum].d) {
                 link[i].I = 0; //空間的接続条件のみ
             }
         }
@@ -684,9 +1116,9 @@ void get_I_for_action(Network *link, int n1, Demand demand, int demandnum, V_Sta
 }
 
 /*状態と行動との組み合わせ数の計算*/
-unsigned long long how_many_actions(Network *link, int n1, State *state, unsigned long long n3, Demand *demand, int n4)
+unsigned long long how_many_actions(Network *link, int n1, State *state, unsigned long long n3, Demand *demand, int n4, Adjacency *adj)
 {
-    int k, l, i;
+    int k, i;
     unsigned long long tmp1, tmp2, tmp3;
     unsigned long long count, s;
     
@@ -694,18 +1126,13 @@ unsigned long long how_many_actions(Network *link, int n1, State *state, unsigne
     for (s = 0; s < n3; s++) {
         tmp2 = 1;
         for (i = 0; i < VNUMBER; i++) {
-            tmp1 = 0;
-            for (l = 0; l < n1; l++) {
-                if (state[s].vs[i].link.d == link[l].o) {
-                    tmp1++;
-                }
-            }
+            tmp1 = adj->offset[get_link(&state[s], i) + 1] - adj->offset[get_link(&state[s], i)];
             tmp2 *= tmp1; //リンクの空間的接続条件のみを配慮
         }
         
         tmp3 = 1;
         for (k = 0; k < n4; k++) {
-            if (state[s].vs[0].sf[k] == 1) { //vs[0]が1だったら他も全部1
+            if (get_sf(&state[s], 0, k) == 1) { //車両0が1だったら他も全部1
                 tmp3 *= (VNUMBER + 1);
             } else { //vs[0]が0じゃなかったら0は含まれない
                 tmp3 *= 1;
@@ -736,7 +1163,7 @@ unsigned long long how_many_actions(Network *link, int n1, State *state, unsigne
 //
 //        tmp3 = 1;
 //        for (k = 0; k < n4; k++) {
-//            if (state[s].vs[0].sf[k] == 1) { //vs[0]が1だったら他も全部1
+//            if (get_sf(&state[s], 0, k) == 1) { //車両0が1だったら他も全部1
 //                tmp3 *= (VNUMBER + 1);
 //            } else { //vs[0]が0じゃなかったら0は含まれない
 //                tmp3 *= 1;
@@ -750,7 +1177,7 @@ unsigned long long how_many_actions(Network *link, int n1, State *state, unsigne
 }
 
 /*行動の列挙・格納*/
-void set_action(Action *action, unsigned long long n1, Network *link, int n2, State *state, unsigned long long n3, Demand *demand, int n4) //n4はOD数
+void set_action(Action *action, unsigned long long n1, Network *link, int n2, State *state, unsigned long long n3, Demand *demand, int n4, int *hop, Adjacency *adj) //n4はOD数
 {
     int i, k, l, kk, ii;
     unsigned long long N1, N2, s, a, tmp1;
@@ -766,12 +1193,7 @@ void set_action(Action *action, unsigned long long n1, Network *link, int n2, St
         N2 = 1;
         
         for (i = 0; i < VNUMBER; i++) {
-            tmp1 = 0;
-            for (l = 0; l < n2; l++) {
-                if (state[s].vs[i].link.d == link[l].o) {
-                    tmp1++;
-                }
-            }
+            tmp1 = adj->offset[get_link(&state[s], i) + 1] - adj->offset[get_link(&state[s], i)];
             N1 *= tmp1;
         }
         
@@ -792,13 +1214,17 @@ void set_action(Action *action, unsigned long long n1, Network *link, int n2, St
 //        }
         
         for (k = 0; k < n4; k++) {
-            if (state[s].vs[0].sf[k] == 1) { //vs[0]が1だったら他も全部1
+            if (get_sf(&state[s], 0, k) == 1) { //車両0が1だったら他も全部1
                 N2 *= (VNUMBER + 1);
             } else {
                 N2 *= 1; //受理/棄却の組み合わせ数
             }
         }
         
+        /*この状態の行動の範囲（行動は状態ごとにまとめて並ぶ）*/
+        state[s].firstaction = count;
+        state[s].numaction = N1 * N2;
+        
         for (k1 = 0; k1 < N1; k1++) {
             for (k2 = 0; k2 < N2; k2++) {
                 K1 = k1;
@@ -824,12 +1250,7 @@ void set_action(Action *action, unsigned long long n1, Network *link, int n2, St
                 for (i = 0; i < VNUMBER; i++) {
                     deno = 1;
                     for (ii = i + 1; ii < VNUMBER; ii++) {
-                        tmp1 = 0;
-                        for (l = 0; l < n2; l++) {
-                            if (state[s].vs[ii].link.d == link[l].o) {
-                                tmp1++;
-                            }
-                        }
+                        tmp1 = adj->offset[get_link(&state[s], ii) + 1] - adj->offset[get_link(&state[s], ii)];
                         
 //                        for (l = 0; l < n2; l++) {
 //                            link[l].I = 1;
@@ -851,41 +1272,27 @@ void set_action(Action *action, unsigned long long n1, Network *link, int n2, St
 //                    for (k = 0; k < n4; k++) {
 //                        get_I_for_action(link, n2, demand[k], k, state[s].vs[i], state[s].t, d, Q);
 //                    }
-                    count3 = 0;
-                    for (l = 0; l < n2; l++) {
-                        if (state[s].vs[i].link.d == link[l].o) {
-                            if (count3 == K1 / deno) {
-                                action[count].va[i].nextlink = link[l];
-                            }
-                            count3++;
-                        }
-                        
-//                        if (link[l].I) {
-//                            if (count3 == K1 / deno) {
-//                                action[count].va[i].nextlink = link[l];
-//                            }
-//                            count3++;
-//                        }
-                    }
-                    if (K1 / deno > count3) {
+                    count3 = adj->offset[get_link(&state[s], i) + 1] - adj->offset[get_link(&state[s], i)];
+                    if (K1 / deno >= count3) {
                         puts("K1 / denoの値が不正です-1");
                         printf("K1 / deno = %llu\n", K1 / deno);
                         exit(EXIT_FAILURE);
                     }
+                    action[count].va[i].nextlink = link[adj->next[adj->offset[get_link(&state[s], i)] + K1 / deno]]; //K1 / deno番目の接続先
                     K1 %= deno;
                 }
                 
                 for (k = 0; k < n4; k++) {
                     deno = 1;
                     for (kk = k + 1; kk < n4; kk++) {
-                        if (state[s].vs[0].sf[kk] == 1) { //vs[0]が1だったら他も全部1
+                        if (get_sf(&state[s], 0, kk) == 1) { //車両0が1だったら他も全部1
                             deno *= (VNUMBER + 1);
                         } else {
                             deno *= 1;
                         }
                     }
                     
-                    if (state[s].vs[0].sf[k] == 1) {
+                    if (get_sf(&state[s], 0, k) == 1) {
                         if (K2 / deno > VNUMBER) {
                             puts("K2 / denoの値が不正です-2");
                             printf("K2 / deno = %llu\n", K2 / deno);
@@ -948,7 +1355,7 @@ void set_action(Action *action, unsigned long long n1, Network *link, int n2, St
                 link[l].I = 1;
             }
             for (k = 0; k < n4; k++) {
-                get_I_for_action(link, n2, demand[k], k, action[a].nowstate.vs[i], action[a].nowstate.t);
+                get_I_for_action(link, n2, demand[k], k, &action[a].nowstate, i, hop);
             }
             
             if (link[action[a].va[i].nextlink.num].I == 0) {
@@ -964,20 +1371,7 @@ void set_action(Action *action, unsigned long long n1, Network *link, int n2, St
         action[a].r = 0.0;
         for (i = 0; i < VNUMBER; i++) {
             for (k = 0; k < n4; k++) {
-                int onum = -1, dnum = -1;
-                for (l = 0; l < n2; l++) {
-                    if (link[l].id == (demand[k].o / 10) * 1000 + (demand[k].o % 10) * 10) { //アドホック
-                        onum = l; //O^L_kの配列番号の探索
-                    }
-                    if (link[l].id == (demand[k].d / 10) * 1000 + (demand[k].d % 10) * 10) { //アドホック
-                        dnum = l;
-                    }
-                }
-                if (onum == -1 || dnum == -1) {
-                    puts("onumまたはdnumが見つかりませんでした．");
-                    exit(EXIT_FAILURE);
-                }
-                action[a].r += action[a].va[i].x[k] * (F0 + F * dijkstra(link[onum].id, link[dnum].id, link, n2));
+                action[a].r += action[a].va[i].x[k] * (F0 + F * get_hop(hop, n2, demand[k].onum, demand[k].dnum));
             }
             action[a].r -= action[a].va[i].nextlink.c;
         }
@@ -1104,15 +1498,94 @@ void set_network2(Network *link2, Network *linklist2, char *in_network2, int n)
     return;
 }
 
+/*gRLの作業領域をリンク数n以上に拡張する（確保済みの領域はそのまま使う）*/
+void reserve_grl_work(Grl_Work *work, int n)
+{
+    Network *tmp_link3;
+    double *tmp_q;
+    int *tmp_dist, *tmp_queue;
+
+    if (n > work->n) {
+        tmp_link3 = (Network *)realloc(work->link3, sizeof(Network) * GRL_LANES * n);
+        tmp_q = (double *)realloc(work->q, sizeof(double) * GRL_LANES * n);
+        tmp_dist = (int *)realloc(work->dist, sizeof(int) * n);
+        tmp_queue = (int *)realloc(work->queue, sizeof(int) * n);
+        if (tmp_link3 == NULL || tmp_q == NULL || tmp_dist == NULL || tmp_queue == NULL) {
+            puts("gRLの作業領域のメモリ確保に失敗しました．");
+            exit(EXIT_FAILURE);
+        }
+        work->link3 = tmp_link3;
+        work->q = tmp_q;
+        work->dist = tmp_dist;
+        work->queue = tmp_queue;
+        work->n = n;
+    }
+
+    return;
+}
+
+/*gRLの作業領域の解放*/
+void free_grl_work(Grl_Work *work)
+{
+    free(work->link3);
+    free_adjacency(&work->adj3);
+    free_adjacency(&work->radj3);
+    free(work->q);
+    free(work->dist);
+    free(work->queue);
+
+    return;
+}
+
+/*並列計算に用いるスレッド数*/
+int use_threads(void)
+{
+#ifdef _OPENMP
+    return (THREADS > 0) ? THREADS : omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+/*実行中のスレッドの番号（作業領域の選択用）*/
+int thread_number(void)
+{
+#ifdef _OPENMP
+    return omp_get_thread_num();
+#else
+    return 0;
+#endif
+}
+
 /*指示関数Iの決定（gRL）*/
-void get_I(Network *link3, int n1, Demand demand)
+/*出発地からの最短時間は順方向，目的地までの最短時間は逆方向の幅優先探索1回ずつで求める*/
+void get_I(Network *link3, int n1, Demand demand, Adjacency *adj, Adjacency *radj, Grl_Work *work)
 {
     int i, t;
+    int onumber = -1, dnumber = -1;
 
-    /*最小所要時間を求める*/
     for (i = 0; i < n1; i++) {
-        link3[i].mincost_o = dijkstra(demand.o, link3[i].id, link3, n1); //O_iから現在地までの最短時間
-        link3[i].mincost_d = dijkstra(link3[i].id, demand.d, link3, n1); //現在地からD_iまでの最短時間
+        if (link3[i].id == demand.o) {
+            onumber = i;
+        }
+        if (link3[i].id == demand.d) {
+            dnumber = i;
+        }
+    }
+    if (onumber == -1 || dnumber == -1) {
+        puts("onumberまたはdnumberが見つかりませんでした．");
+        exit(EXIT_FAILURE);
+    }
+
+    /*最小所要時間を求める（到達できないリンクは指示関数が0になるよう十分大きくする）*/
+    reserve_grl_work(work, n1);
+    bfs(onumber, adj, n1, work->dist, work->queue);
+    for (i = 0; i < n1; i++) {
+        link3[i].mincost_o = (work->dist[i] < 0) ? UINT_MAX / 2 : work->dist[i]; //O_iから現在地までの最短時間
+    }
+    bfs(dnumber, radj, n1, work->dist, work->queue);
+    for (i = 0; i < n1; i++) {
+        link3[i].mincost_d = (work->dist[i] < 0) ? UINT_MAX / 2 : work->dist[i]; //現在地からD_iまでの最短時間
     }
     
     /*指示関数Iを決定*/
@@ -1129,24 +1602,36 @@ void get_I(Network *link3, int n1, Demand demand)
     return;
 }
 
+/*時刻tに遷移先リンクjを選ぶときの指数部(v_j(t) + βV_j(t+1)) / μ（とれないリンクは-DBL_MAX）*/
+double grl_exponent(Network *link3, int j, int t)
+{
+    if (link3[j].II[t + 1] && link3[j].v[t] > -DBL_MAX / 2) {
+        return (link3[j].v[t] + beta * link3[j].V[t + 1]) / mu;
+    }
+
+    return -DBL_MAX;
+}
+
 /*後ろ向き帰納法で期待最大効用を求める（gRL）*/
-void backward_induction_for_grl(Network *link3, int n1, Demand demand, int num2)
+/*V_i(t) = μ log Σ_j exp((v_j(t) + βV_j(t+1)) / μ)を行ごとの最大値を引いて計算する．入札確率に必要な時刻t_i^Bまでで止める*/
+/*接続関係が同じ需要list[0], ..., list[lanes - 1]（ネットワークはlink3 + n1 * k）を時刻をそろえて同時に計算する*/
+/*指数部は需要を内側にしてq[GRL_LANES * j + k]に並べ，時刻が[t_i^B, t_i^E)の外の需要と余りのレーンは計算しない*/
+void backward_induction_for_grl(Network *link3, int n1, Demand *demand, int *list, int lanes, int num2, Adjacency *adj, Grl_Work *work)
 {
-    int i, j, t;
+    int i, j, k, t, e, next;
+    int tb, te;
     int dnumber = -1;
-    double M2[Tmax + 1][n1][n1];
-    double suminlog;
-    
-    /*前準備．t_i^B - 1においてO_iと待ちリンク以外の即時効用を-∞にする*/
-    for (i = 0; i < n1; i++) {
-        if (link3[i].id != demand.o && i < n1 - num2) { //i >= n1 - num2は待ちリンク
-            link3[i].v[demand.tb - 1] = -DBL_MAX;
-        }
-    }
+    unsigned short active[GRL_LANES]; //時刻tに計算する需要か
+    double qmax[GRL_LANES], sum[GRL_LANES];
+    double *q;
+    Network *l;
     
-    /*Step 1*/
+    reserve_grl_work(work, n1);
+    q = work->q;
+
+    /*目的地ダミーリンク（接続関係が同じなので全ての需要で共通）*/
     for (i = 0; i < n1; i++) {
-        if (link3[i].id == demand.d) {
+        if (link3[i].id == demand[list[0]].d) {
             dnumber = i;
         }
     }
@@ -1155,45 +1640,81 @@ void backward_induction_for_grl(Network *link3, int n1, Demand demand, int num2)
         exit(0);
     }
 
-    for (t = demand.tb - 1; t <= demand.te; t++) {
-        link3[dnumber].V[t] = 0; //目的地ダミーリンクの期待最大効用は0
-    }
+    tb = INT_MAX;
+    te = 0;
+    for (k = 0; k < lanes; k++) {
+        l = link3 + n1 * k;
 
-    for (t = demand.tb - 1; t <= demand.te; t++) {
+        /*前準備．t_i^B - 1においてO_iと待ちリンク以外の即時効用を-∞にする*/
         for (i = 0; i < n1; i++) {
-            for (j = 0; j < n1; j++) {
-                if (link3[i].d == link3[j].o) {
-                    M2[t][i][j] = link3[i].II[t] * link3[j].II[t + 1] * pow(M_E, link3[j].v[t] / mu);
-                } else {
-                    M2[t][i][j] = 0;
-                }
+            if (l[i].id != demand[list[k]].o && i < n1 - num2) { //i >= n1 - num2は待ちリンク
+                l[i].v[demand[list[k]].tb - 1] = -DBL_MAX;
             }
         }
-    }
 
-    /*Step 2*/
-    t = demand.te;
-    for (i = 0; i < n1; i++) {
-        link3[i].V[t] = 0;
+        /*Step 1*/
+        for (t = demand[list[k]].tb - 1; t <= demand[list[k]].te; t++) {
+            l[dnumber].V[t] = 0; //目的地ダミーリンクの期待最大効用は0
+        }
+
+        /*Step 2*/
+        for (i = 0; i < n1; i++) {
+            l[i].V[demand[list[k]].te] = 0;
+        }
+
+        tb = (demand[list[k]].tb < tb) ? demand[list[k]].tb : tb;
+        te = (demand[list[k]].te > te) ? demand[list[k]].te : te;
     }
 
     /*Step 3*/
-    while (t != demand.tb - 1) {
+    t = te;
+    while (t > tb) {
         t -= 1;
+
+        for (k = 0; k < GRL_LANES; k++) {
+            active[k] = (k < lanes && demand[list[k]].tb <= t && t < demand[list[k]].te);
+        }
+
+        /*遷移先ごとの指数部（時刻tで1回だけ計算する）*/
+        for (j = 0; j < n1; j++) {
+            for (k = 0; k < GRL_LANES; k++) {
+                q[GRL_LANES * j + k] = (active[k]) ? grl_exponent(link3 + n1 * k, j, t) : -DBL_MAX;
+            }
+        }
+
         for (i = 0; i < n1; i++) {
-            suminlog = 0;
+            /*行の最大値（オーバーフロー対策）*/
+            for (k = 0; k < GRL_LANES; k++) {
+                qmax[k] = -DBL_MAX;
+                sum[k] = 0;
+            }
+            for (e = adj->offset[i]; e < adj->offset[i + 1]; e++) {
+                next = GRL_LANES * adj->next[e];
+                for (k = 0; k < GRL_LANES; k++) {
+                    qmax[k] = (q[next + k] > qmax[k]) ? q[next + k] : qmax[k];
+                }
+            }
+            for (k = 0; k < lanes; k++) {
+                if (!active[k] || !link3[n1 * k + i].II[t]) {
+                    qmax[k] = -DBL_MAX;
+                }
+            }
 
-            if (t == demand.te || i == dnumber) {
-                link3[i].V[t] = 0;
-            } else {
-                for (j = 0; j < n1; j++) {
-                    suminlog += M2[t][i][j] * pow(M_E, beta * link3[j].V[t + 1] / mu);
+            for (e = adj->offset[i]; e < adj->offset[i + 1]; e++) {
+                next = GRL_LANES * adj->next[e];
+                for (k = 0; k < GRL_LANES; k++) {
+                    sum[k] += (qmax[k] > -DBL_MAX / 2) ? exp(q[next + k] - qmax[k]) : 0; //とれないリンクはexp(-∞) = 0
                 }
+            }
 
-                if (suminlog == 0) {
-                    link3[i].V[t] = 0;
+            for (k = 0; k < lanes; k++) {
+                if (!active[k]) {
+                    continue;
+                }
+                if (i == dnumber || sum[k] == 0) {
+                    link3[n1 * k + i].V[t] = 0;
                 } else {
-                    link3[i].V[t] = mu * log(suminlog);
+                    link3[n1 * k + i].V[t] = mu * (qmax[k] + log(sum[k]));
                 }
             }
         }
@@ -1202,108 +1723,103 @@ void backward_induction_for_grl(Network *link3, int n1, Demand demand, int num2)
     return;
 }
 
-/*遷移確率行列を求める（gRL）*/
-void get_prob_matrix(Network *link3, int n1, Demand demand, double *pr)
+/*時刻t_i^B - 1に出発地リンクonumから待ちリンクwnumを選ぶ確率（入札確率）を求める（gRL）*/
+/*時刻t_i^Bの期待最大効用を使い，出発地リンクの行の選択確率だけを計算する*/
+/*待ちリンクの効用の定数項だけが異なる問題は期待最大効用が共通なので，定数項b[k]ごとの確率prob[k]をまとめて求める*/
+void get_bid_prob(Network *link3, Demand demand, Adjacency *adj, int onum, int wnum, double *b, double *prob)
 {
-    double deno;
-    int t, i, j;
-    
-    for (t = demand.tb - 1; t <= demand.te; t++) {
-        for (i = 0; i < n1; i++) {
-            deno = 0;
-
-            for (j = 0; j < n1; j++) {
-                if (link3[i].d == link3[j].o) {
-                    deno += link3[i].II[t] * link3[j].II[t + 1] * pow(M_E, (link3[j].v[t] + beta * link3[j].V[t + 1]) / mu);
-                    //if (pow(M_E, (link3[j].v[t] + beta * link3[j].V[t + 1]) / mu) > 0) {
-                    //    puts("a");
-                    //    printf("link3[%d].II[%d] = %d\n", i, t, link3[i].II[t]);
-                    //    printf("link3[%d].II[%d] = %d\n", j, t + 1, link3[j].II[t + 1]);
-                    //    printf("link3[%d].v[%d] = %f\n", j, t, link3[j].v[t] + beta * link3[j].V[t + 1]);
-                    //}
-                }
+    int e, k, found;
+    int t = demand.tb - 1;
+    double qj, qw;
+    double qw_k[WAIT_CONSTS], qmax[WAIT_CONSTS], sum[WAIT_CONSTS];
+
+    /*待ちリンクを選べない場合は0*/
+    found = 0;
+    for (e = adj->offset[onum]; e < adj->offset[onum + 1]; e++) {
+        if (adj->next[e] == wnum) {
+            found = 1;
+        }
+    }
+    if (!found || link3[onum].II[t] == 0 || link3[wnum].II[t + 1] == 0 || link3[onum].id == demand.d) {
+        for (k = 0; k < WAIT_CONSTS; k++) {
+            prob[k] = 0;
+        }
+        return;
+    }
+
+    /*待ちリンクの指数部だけが定数項によって変わる*/
+    qw = grl_exponent(link3, wnum, t);
+    for (k = 0; k < WAIT_CONSTS; k++) {
+        qw_k[k] = (qw > -DBL_MAX / 2) ? qw + b[k] / mu : -DBL_MAX;
+        qmax[k] = qw_k[k];
+    }
+    for (e = adj->offset[onum]; e < adj->offset[onum + 1]; e++) {
+        if (adj->next[e] != wnum) {
+            qj = grl_exponent(link3, adj->next[e], t);
+            for (k = 0; k < WAIT_CONSTS; k++) {
+                qmax[k] = (qj > qmax[k]) ? qj : qmax[k];
             }
-            //printf("deno = %f\n", deno);
+        }
+    }
+    for (k = 0; k < WAIT_CONSTS; k++) {
+        if (qmax[k] < -DBL_MAX / 2) {
+            puts("gRLの選択確率の分母が0です．");
+            exit(EXIT_FAILURE);
+        }
+        sum[k] = exp(qw_k[k] - qmax[k]);
+    }
 
-            for (j = 0; j < n1; j++) {
-                if (link3[i].d != link3[j].o || link3[i].II[t] == 0 || link3[j].II[t + 1] == 0) {
-                    pr[n1 * n1 * t + n1 * i + j] = 0;
-                } else if (link3[i].id == demand.d) {
-                    pr[n1 * n1 * t + n1 * i + j] = 0;
-                    pr[n1 * n1 * t + n1 * i + i] = 1; //目的地に着いたら他のリンクには移動しない
-                } else {
-                    if (deno == 0) {
-                        puts("gRLの選択確率の分母が0です．");
-                        exit(EXIT_FAILURE);
-                    }
-                    pr[n1 * n1 * t + n1 * i + j] = pow(M_E, (link3[j].v[t] + beta * link3[j].V[t + 1]) / mu) / deno;
-                }
-                //if (t == demand.tb - 1) {
-                    //printf("link3[%d].v[%d] = %f\n", j, t, link3[j].v[t]);
-                    //printf("link3[%d].V[%d] = %f\n", j, t + 1, link3[j].V[t + 1]);
-                //    printf("pr[%d][%d][%d] = %f\n", t, i, j, pr[n1 * n1 * t + n1 * i + j]);
-                //}
+    for (e = adj->offset[onum]; e < adj->offset[onum + 1]; e++) {
+        if (adj->next[e] != wnum) {
+            qj = grl_exponent(link3, adj->next[e], t);
+            for (k = 0; k < WAIT_CONSTS; k++) {
+                sum[k] += exp(qj - qmax[k]); //とれないリンクはexp(-∞) = 0
             }
         }
     }
 
+    for (k = 0; k < WAIT_CONSTS; k++) {
+        prob[k] = exp(qw_k[k] - qmax[k]) / sum[k];
+    }
+
     return;
 }
 
-/*需要ごとにデマンド交通リンクを追加し，gRLで配分し，入札確率を求める*/
-/*デマンド交通のリンクの位置(id)を与えて入札確率を返す*/
-void grl_assignment(Network *link2, int n1, Demand *demand, int n2, Network *link, int n3, Action action, double *P)
+/*gRLの需要側ネットワークの前計算．需要側リンクの複製と即時効用，出発地・目的地リンク，接続関係を需要ごとに1回だけ求める*/
+void set_grl_net(Grl_Net *net, Network *link2, int n1, Demand *demand, int n2)
 {
     int i, j, t;
-    int num1; //デマンド交通リンクの本数
-    int num2; //待ちリンクの本数
-    int N; //link3の要素数
-    int idmax = INT_MAX; //変えないこと
-    int nidmax = INT_MAX;
-    int onum, dnum;
-    double tmp;
-    Network link3[256];
-    double pr[2048];
-
-    for (i = 0; i < n2; i++) { //全ての需要についての繰り返し
-        /*----------デマンド交通リンクと待ちリンクを追加してリンクデータを完成----------*/
-        num1 = (int)(demand[i].e * (dijkstra((demand[i].o / 10) * 1000 + (demand[i].o % 10) * 10, (demand[i].d / 10) * 1000 + (demand[i].d % 10) * 10, link, n3) - 1));
-        
-        tmp = 0.0;
-        for (j = 0; j < VNUMBER; j++) {
-            tmp += demand[i].e * dijkstra(action.va[j].nextlink.id, (demand[i].o / 10) * 1000 + (demand[i].o % 10) * 10, link, n3);
-        }
-        tmp /= VNUMBER;
-        if (tmp <= 1) {
-            num2 = 1;
-        } else {
-            num2 = tmp - 1;
-        }
-        
-        N = n1 + num1 + num2;
-//        link3 = (Network *)realloc(link3, sizeof(Network) * N);
-//        pr = (double * )realloc(pr, sizeof(double) * N * N * (Tmax + 1));
-//        if (link3 == NULL || pr == NULL) {
-//            puts("メモリ不足7");
-//            exit(EXIT_FAILURE);
-//        }
+    Network *link3;
+
+    net->n1 = n1;
+    net->n2 = n2;
+    net->base = (Network *)malloc(sizeof(Network) * n1 * n2);
+    net->onum = (int *)malloc(sizeof(int) * n2);
+    net->dnum = (int *)malloc(sizeof(int) * n2);
+    net->dorder = (int *)malloc(sizeof(int) * 2 * (n1 > 0 ? n1 : 1));
+    if (net->base == NULL || net->onum == NULL || net->dnum == NULL || net->dorder == NULL) {
+        puts("gRLの需要側ネットワークのメモリ確保に失敗しました．");
+        exit(EXIT_FAILURE);
+    }
 
-        onum = -1;
-        dnum = -1;
+    for (i = 0; i < n2; i++) {
+        net->onum[i] = -1;
+        net->dnum[i] = -1;
         for (j = 0; j < n1; j++) {
             if (link2[j].id == demand[i].o) {
-                onum = j;
+                net->onum[i] = j;
             }
             if (link2[j].id == demand[i].d) {
-                dnum = j;
+                net->dnum[i] = j;
             }
         }
-        if (onum == -1 || dnum == -1) {
+        if (net->onum[i] == -1 || net->dnum[i] == -1) {
             puts("onumまたはdnumが見つかりません．");
             exit(EXIT_FAILURE);
         }
 
         /*デマンド交通リンク以外はlink2の複製で良い・ついでに即時効用の格納*/
+        link3 = net->base + n1 * i;
         for (j = 0; j < n1; j++) {
             link3[j] = link2[j];
             for (t = 0; t <= Tmax; t++) {
@@ -1313,87 +1829,378 @@ void grl_assignment(Network *link2, int n1, Demand *demand, int n2, Network *lin
                 link3[j].v[demand[i].tb - 1] = -DBL_MAX;
             }
         }
-        
-        /*デマンド交通のネットワーク*/
-        link3[n1].id = idmax - num1 + 1;
-        link3[n1].o = -nidmax;
-        link3[n1].d = nidmax - num1 + 1;
-        for (t = 0; t <= Tmax; t++) { //1本目
-            link3[n1].v[t] = demand[i].beta_time * STEPTIME; //料金は先払いなので時間のみ
+    }
+
+    /*接続関係（追加リンクをつなぐときの探索用に起点・終点ノード順の組も残す）*/
+    net->adj = (Adjacency){NULL, NULL, NULL, 0, 0};
+    set_adjacency(&net->adj, link2, n1);
+    for (j = 0; j < n1; j++) {
+        net->dorder[2 * j] = link2[j].d;
+        net->dorder[2 * j + 1] = j;
+    }
+    qsort(net->dorder, n1, sizeof(int) * 2, compare_node);
+
+    printf("gRLの需要側ネットワークの前計算完了\n");
+
+    return;
+}
+
+/*gRLの需要側ネットワークの解放*/
+void free_grl_net(Grl_Net *net)
+{
+    free(net->base);
+    free_adjacency(&net->adj);
+    free(net->dorder);
+    free(net->onum);
+    free(net->dnum);
+    free(net->num1);
+    free(net->maxnum2);
+    free(net->bidstart);
+    free(net->bid);
+
+    return;
+}
+
+/*需要側リンクの接続関係に，追加したデマンド交通リンク・待ちリンク（配列番号n1以降）をつなぎ込んでlink3の接続関係を作る*/
+void splice_adjacency(Adjacency *adj, Grl_Net *net, Network *link3, int N)
+{
+    int i, c, c2, m, e;
+    int n1 = net->n1;
+    int *pos; //リンクごとの追加の接続先の数→次の格納位置
+
+    reserve_adjacency(adj, N, 0);
+    pos = adj->order;
+
+    /*接続先の数を数える*/
+    for (i = 0; i < N; i++) {
+        pos[i] = 0;
+    }
+    for (c = n1; c < N; c++) {
+        for (m = lower_node(net->dorder, n1, link3[c].o); m < n1 && net->dorder[2 * m] == link3[c].o; m++) {
+            pos[net->dorder[2 * m + 1]]++; //追加リンクcの手前の需要側リンク
         }
-        if (num1 == 1) {
-            link3[n1].d = link3[dnum].o;
+        for (m = lower_node(net->adj.order, n1, link3[c].d); m < n1 && net->adj.order[2 * m] == link3[c].d; m++) {
+            pos[c]++; //追加リンクcの先の需要側リンク
         }
-        
-        for (j = n1 + 1; j < n1 + num1; j++) { //2本目以降
-            link3[j].id = link3[j - 1].id + 1;
-            link3[j].o = link3[j - 1].d;
-            if (j != n1 + num1 - 1) {
-                link3[j].d = link3[j - 1].d + 1;
-            } else {
-                link3[j].d = link3[dnum].o;
+        for (c2 = n1; c2 < N; c2++) {
+            if (link3[c].d == link3[c2].o) {
+                pos[c]++;
             }
-            
-            for (t = 0; t < Tmax; t++) {
-                link3[j].v[t] = demand[i].beta_time * STEPTIME; //料金は先払いなので時間のみ
+        }
+    }
+    adj->offset[0] = 0;
+    for (i = 0; i < N; i++) {
+        adj->offset[i + 1] = adj->offset[i] + pos[i];
+        if (i < n1) {
+            adj->offset[i + 1] += net->adj.offset[i + 1] - net->adj.offset[i];
+        }
+    }
+    reserve_adjacency(adj, N, adj->offset[N]);
+
+    /*接続先を格納（追加リンクは配列番号が大きいので，後ろに足せば配列番号の小さい順のまま）*/
+    for (i = 0; i < n1; i++) {
+        pos[i] = adj->offset[i];
+        for (e = net->adj.offset[i]; e < net->adj.offset[i + 1]; e++) {
+            adj->next[pos[i]] = net->adj.next[e];
+            pos[i]++;
+        }
+    }
+    for (c = n1; c < N; c++) {
+        for (m = lower_node(net->dorder, n1, link3[c].o); m < n1 && net->dorder[2 * m] == link3[c].o; m++) {
+            adj->next[pos[net->dorder[2 * m + 1]]] = c;
+            pos[net->dorder[2 * m + 1]]++;
+        }
+        e = adj->offset[c];
+        for (m = lower_node(net->adj.order, n1, link3[c].d); m < n1 && net->adj.order[2 * m] == link3[c].d; m++) {
+            adj->next[e] = net->adj.order[2 * m + 1];
+            e++;
+        }
+        for (c2 = n1; c2 < N; c2++) {
+            if (link3[c].d == link3[c2].o) {
+                adj->next[e] = c2;
+                e++;
             }
         }
-        
-        /*待ちリンク*/
-        link3[n1 + num1].id = idmax - num1 - num2 + 1;
-        link3[n1 + num1].o = link3[onum].d;
-        link3[n1 + num1].d = nidmax - num1 - num2 + 1;
-        for (t = 0; t < Tmax; t++) { //1本目
-            if (t == demand[i].tb - 1) {
-                link3[n1 + num1].v[t] = b_service + demand[i].beta_time * STEPTIME + demand[i].beta_fare * (F0 + F * num1) + demand[i].beta_exp; //料金は先払い・経験による信頼度も含めて判断・定数項もここで固定で効いてくる
-            } else {
-                link3[n1 + num1].v[t] = -DBL_MAX;
+    }
+
+    return;
+}
+
+/*需要iの需要側ネットワークにデマンド交通リンクnum1本と待ちリンクnum2本を追加してlink3を完成させる*/
+/*リンクの番号・起点・終点は出発地・目的地リンクとnum1・num2だけで決まり，需要ごとに違うのは即時効用のみ*/
+void grl_links(Grl_Net *net, Demand *demand, int i, int num1, int num2, Network *link3)
+{
+    int j, t;
+    int n1 = net->n1; //需要側のリンク数
+    int idmax = INT_MAX; //変えないこと
+    int nidmax = INT_MAX;
+    int onum, dnum;
+
+    onum = net->onum[i];
+    dnum = net->dnum[i];
+
+    /*デマンド交通リンク以外は前計算した複製を使う*/
+    for (j = 0; j < n1; j++) {
+        link3[j] = net->base[n1 * i + j];
+    }
+
+    /*デマンド交通のネットワーク*/
+    link3[n1].id = idmax - num1 + 1;
+    link3[n1].o = -nidmax;
+    link3[n1].d = nidmax - num1 + 1;
+    for (t = 0; t <= Tmax; t++) { //1本目
+        link3[n1].v[t] = demand[i].beta_time * STEPTIME; //料金は先払いなので時間のみ
+    }
+    if (num1 == 1) {
+        link3[n1].d = link3[dnum].o;
+    }
+
+    for (j = n1 + 1; j < n1 + num1; j++) { //2本目以降
+        link3[j].id = link3[j - 1].id + 1;
+        link3[j].o = link3[j - 1].d;
+        if (j != n1 + num1 - 1) {
+            link3[j].d = link3[j - 1].d + 1;
+        } else {
+            link3[j].d = link3[dnum].o;
+        }
+    
+        for (t = 0; t < Tmax; t++) {
+            link3[j].v[t] = demand[i].beta_time * STEPTIME; //料金は先払いなので時間のみ
+        }
+    }
+
+    /*待ちリンク*/
+    link3[n1 + num1].id = idmax - num1 - num2 + 1;
+    link3[n1 + num1].o = link3[onum].d;
+    link3[n1 + num1].d = nidmax - num1 - num2 + 1;
+    for (t = 0; t < Tmax; t++) { //1本目
+        if (t == demand[i].tb - 1) {
+            link3[n1 + num1].v[t] = demand[i].beta_time * STEPTIME + demand[i].beta_fare * (F0 + F * num1) + demand[i].beta_exp; //料金は先払い・経験による信頼度も含めて判断・定数項は入札確率を求めるときに加える
+        } else {
+            link3[n1 + num1].v[t] = -DBL_MAX;
+        }
+    }
+    if (num2 == 1) {
+        link3[n1 + num1].d = link3[n1].o;
+    }
+
+    for (j = n1 + num1 + 1; j < n1 + num1 + num2; j++) { //2本目以降
+        link3[j].id = link3[j - 1].id + 1;
+        link3[j].o = link3[j - 1].d;
+        if (j != n1 + num1 + num2 - 1) {
+            link3[j].d = link3[j - 1].d + 1;
+        } else {
+            link3[j].d = link3[n1].o;
+        }
+    
+        for (t = 0; t < Tmax; t++) {
+            link3[j].v[t] = demand[i].beta_time * STEPTIME; //料金は先払いなので時間のみ
+        }
+    }
+
+    return;
+}
+
+/*出発地・目的地リンクとnum1・num2が同じ需要list[0], ..., list[lanes - 1]にデマンド交通リンクと待ちリンクを追加し，まとめてgRLで配分して入札確率を求める*/
+/*待ちリンクの効用の定数項b[c]は期待最大効用に効かないので，1回の計算で需要list[k]の定数項ごとの入札確率prob[WAIT_CONSTS * k + c]を求める*/
+void grl_solve(Grl_Net *net, Demand *demand, int *list, int lanes, int num1, int num2, double *b, double *prob, Grl_Work *w)
+{
+    int k;
+    int n1 = net->n1; //需要側のリンク数
+    int N; //需要1つ分のlink3の要素数
+    Network *link3; //需要ごとのネットワーク（作業領域内）
+
+    /*----------デマンド交通リンクと待ちリンクを追加してリンクデータを完成----------*/
+    N = n1 + num1 + num2;
+    reserve_grl_work(w, N);
+    link3 = w->link3;
+    for (k = 0; k < lanes; k++) {
+        grl_links(net, demand, list[k], num1, num2, link3 + N * k);
+    }
+
+    /*--------------------ここからgRLで配分--------------------*/
+    /*リンクの接続関係（全ての需要で共通なので1つ目の需要で作る）*/
+    splice_adjacency(&w->adj3, net, link3, N);
+    set_reverse_adjacency(&w->radj3, &w->adj3, N);
+
+    /*指示関数の決定*/
+    for (k = 0; k < lanes; k++) {
+        get_I(link3 + N * k, N, demand[list[k]], &w->adj3, &w->radj3, w);
+    }
+
+    /*期待最大効用を求める*/
+    backward_induction_for_grl(link3, N, demand, list, lanes, num2, &w->adj3, w);
+
+    /*出発地リンクから待ちリンクへの選択確率*/
+    for (k = 0; k < lanes; k++) {
+        get_bid_prob(link3 + N * k, demand[list[k]], &w->adj3, net->onum[list[k]], n1 + num1, b, prob + WAIT_CONSTS * k);
+    }
+
+    return;
+}
+
+/*車両ごとのリンクの配列番号vlinkから需要iの待ちリンクの本数を求める（車両から出発地までの平均所要時間で決まる）*/
+int waiting_links(Demand *demand, int i, int n3, int *vlink, int *hop)
+{
+    int j;
+    double tmp;
+
+    tmp = 0.0;
+    for (j = 0; j < VNUMBER; j++) {
+        tmp += demand[i].e * get_hop(hop, n3, vlink[j], demand[i].onum);
+    }
+    tmp /= VNUMBER;
+    if (tmp <= 1) {
+        return 1;
+    } else {
+        return tmp - 1;
+    }
+}
+
+/*入札確率の表の作成．入札確率は行動に待ちリンクの本数を通してしか依存しないので，需要ごとにとりうる本数全てについて1回ずつgRLを解いておく*/
+void set_bid_table(Grl_Net *net, Demand *demand, int n2, int n3, int *hop, Grl_Work *work)
+{
+    int i, j, k, c, g, count, ngroup;
+    int hmax; //出発地までの最大所要時間
+    double tmp;
+    double b[WAIT_CONSTS] = {b_service, 0.0}; //行動に対する入札確率用，初期状態の確率用（定数項なし）
+    int *task; //gRLの計算の組（出発地リンク，目的地リンク，デマンド交通リンクの本数，待ちリンクの本数，需要）
+    int *group; //同時に解く組の開始位置（要素数はngroup + 1）
+    int list[GRL_LANES]; //同時に解く需要
+    double prob[WAIT_CONSTS * GRL_LANES];
+    Grl_Work *w; //このスレッドの作業領域
+
+    net->num1 = (int *)malloc(sizeof(int) * n2);
+    net->maxnum2 = (int *)malloc(sizeof(int) * n2);
+    net->bidstart = (int *)malloc(sizeof(int) * n2);
+    if (net->num1 == NULL || net->maxnum2 == NULL || net->bidstart == NULL) {
+        puts("メモリ不足13.3");
+        exit(EXIT_FAILURE);
+    }
+
+    count = 0;
+    for (i = 0; i < n2; i++) {
+        net->num1[i] = (int)(demand[i].e * (get_hop(hop, n3, demand[i].onum, demand[i].dnum) - 1));
+
+        /*平均所要時間は最大所要時間を超えないので，待ちリンクの本数の上限が決まる*/
+        hmax = 0;
+        for (j = 0; j < n3; j++) {
+            if (hop[n3 * j + demand[i].onum] > hmax) {
+                hmax = hop[n3 * j + demand[i].onum];
             }
         }
-        if (num2 == 1) {
-            link3[n1 + num1].d = link3[n1].o;
+        tmp = demand[i].e * hmax;
+        if (tmp <= 1) {
+            net->maxnum2[i] = 1;
+        } else {
+            net->maxnum2[i] = tmp - 1;
         }
-        
-        for (j = n1 + num1 + 1; j < n1 + num1 + num2; j++) { //2本目以降
-            link3[j].id = link3[j - 1].id + 1;
-            link3[j].o = link3[j - 1].d;
-            if (j != n1 + num1 + num2 - 1) {
-                link3[j].d = link3[j - 1].d + 1;
-            } else {
-                link3[j].d = link3[n1].o;
+
+        net->bidstart[i] = count;
+        count += net->maxnum2[i];
+    }
+
+    net->bid = (double *)malloc(sizeof(double) * WAIT_CONSTS * count);
+    if (count > 0 && net->bid == NULL) {
+        puts("メモリ不足13.4");
+        exit(EXIT_FAILURE);
+    }
+
+    /*(需要, 待ちリンクの本数)の組を並べ，接続関係が同じ組をGRL_LANES個ずつまとめる*/
+    task = (int *)malloc(sizeof(int) * 5 * (count > 0 ? count : 1));
+    group = (int *)malloc(sizeof(int) * (count + 1));
+    if (task == NULL || group == NULL) {
+        puts("メモリ不足13.5");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < n2; i++) {
+        for (k = 1; k <= net->maxnum2[i]; k++) {
+            j = 5 * (net->bidstart[i] + k - 1);
+            task[j] = net->onum[i];
+            task[j + 1] = net->dnum[i];
+            task[j + 2] = net->num1[i];
+            task[j + 3] = k;
+            task[j + 4] = i;
+        }
+    }
+    qsort(task, count, sizeof(int) * 5, compare_task);
+    ngroup = 0;
+    for (j = 0; j < count; j++) {
+        c = (j > 0 && j - group[ngroup - 1] < GRL_LANES); //前の組に入れられるか
+        for (k = 0; k < 4 && c; k++) {
+            c = (task[5 * j + k] == task[5 * (j - 1) + k]);
+        }
+        if (!c) {
+            group[ngroup] = j;
+            ngroup++;
+        }
+    }
+    group[ngroup] = count;
+
+    /*組ごとの計算は独立なので並列に計算する*/
+#ifdef _OPENMP
+#pragma omp parallel num_threads(use_threads()) private(j, k, c, w, list, prob)
+#endif
+    {
+        w = work + thread_number();
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+        for (g = 0; g < ngroup; g++) {
+            for (j = group[g]; j < group[g + 1]; j++) {
+                list[j - group[g]] = task[5 * j + 4];
             }
-            
-            for (t = 0; t < Tmax; t++) {
-                link3[j].v[t] = demand[i].beta_time * STEPTIME; //料金は先払いなので時間のみ
+            grl_solve(net, demand, list, group[g + 1] - group[g], task[5 * group[g] + 2], task[5 * group[g] + 3], b, prob, w);
+            for (j = group[g]; j < group[g + 1]; j++) {
+                k = task[5 * j + 3];
+                for (c = 0; c < WAIT_CONSTS; c++) {
+                    net->bid[WAIT_CONSTS * (net->bidstart[task[5 * j + 4]] + k - 1) + c] = prob[WAIT_CONSTS * (j - group[g]) + c];
+                }
             }
         }
-        
-        /*--------------------ここからgRLで配分--------------------*/
-        /*指示関数の決定*/
-        get_I(link3, N, demand[i]);
+    }
+    free(task);
+    free(group);
 
-        /*期待最大効用を求める*/
-        backward_induction_for_grl(link3, N, demand[i], num2);
+    printf("入札確率の表の作成完了（%d通り，gRLの計算%d回）\n", count, ngroup);
 
-        /*遷移確率行列を求める*/
-        get_prob_matrix(link3, N, demand[i], pr);
+    return;
+}
+
+/*入札確率の表を引いてPに格納する．vlinkは車両ごとのリンクの配列番号，withbは待ちリンクの効用に定数項を入れるかどうか*/
+void get_bid(Grl_Net *net, Demand *demand, int n2, int n3, int *vlink, int withb, double *P, int *hop)
+{
+    int i, t, num2;
 
-        /*入札確率を格納*/
+    for (i = 0; i < n2; i++) {
+        num2 = waiting_links(demand, i, n3, vlink, hop);
+        if (num2 > net->maxnum2[i]) {
+            puts("待ちリンクの本数が入札確率の表の範囲外です．");
+            exit(EXIT_FAILURE);
+        }
         for (t = 0; t <= Tmax; t++) {
-            if (t == demand[i].tb - 1) {
-                P[(Tmax + 1) * i + t] = pr[N * N * t + N * onum + n1 + num1];
-                //printf("%f\n", P[(Tmax + 1) * i + t]);
-                //if (P[(Tmax + 1) * i + t] == 0) {
-                //    printf("個人%d，時刻%dで", i, t);
-                //    puts("入札確率が0です．");
-                //}
-//                printf("P[%d][%d] = %f\n", i, t, P[(Tmax + 1) * i + t]);
+            if (t == demand[i].tb - 1 && num2 > 0) { //待ちリンクがなければ入札できない
+                P[(Tmax + 1) * i + t] = net->bid[WAIT_CONSTS * (net->bidstart[i] + num2 - 1) + (withb ? 0 : 1)];
             } else {
                 P[(Tmax + 1) * i + t] = 0;
             }
         }
     }
-    
+
+    return;
+}
+
+/*行動に対する入札確率を求める*/
+void grl_assignment(Grl_Net *net, Demand *demand, int n2, int n3, Action action, double *P, int *hop)
+{
+    int j;
+    int vlink[VNUMBER]; //行動後の車両のリンクの配列番号
+
+    for (j = 0; j < VNUMBER; j++) {
+        vlink[j] = action.va[j].nextlink.num;
+    }
+    get_bid(net, demand, n2, n3, vlink, 1, P, hop);
+
     return;
 }
 
@@ -1430,353 +2237,298 @@ void grl_assignment(Network *link2, int n1, Demand *demand, int n2, Network *lin
 //    return (int)(frac / (deno1 * deno2));
 //}
 
-/*状態遷移確率の計算*/
-void get_state_trans_prob(Network *link2, int n1, Demand *demand, int n2, Network *link, int n3, State *state, unsigned long long n4, Action *action, unsigned long long n5, double *p, double *P)
+/*状態遷移確率の非ゼロ要素を1つ追加する（足りなければ配列を拡張）*/
+void add_trans(Trans *p, unsigned long long statenum, double prob)
 {
-    unsigned long long i, j;
-//    unsigned long long deno;
-    int k, l, m;
-    double sum = 0.0;
-    int onum, dnum;
-    unsigned short connection;
-    unsigned short cond1, cond2, cond3, cond4, cond5, cond6, out, all_zero;
-
-    for (i = 0; i < n5; i++) {
-//        /*強制終了対策でスリープさせる*/
-//        for (deno = 1; deno <= DENO; deno++) {
-//            if (i == deno * n5 / DENO) {
-//                sleep(5);
-//            }
-//        }
-        
-        if (action[i].presence) {
-            sum = 0.0;
-            
-            grl_assignment(link2, n1, demand, n2, link, n3, action[i], P); //行動に対する入札確率を求める
-            for (j = 0; j < n4; j++) {
-                p[n4 * i + j] = 1;
-                
-                if (action[i].nowstate.t + 1 != state[j].t) {
-                    p[n4 * i + j] = 0.0; //時間的に接続していない状態へは遷移しない
-                    //puts("1"); //
-                    continue;
-                }
-                
-                connection = 1;
-                for (k = 0; k < VNUMBER; k++) {
-                    if (action[i].va[k].nextlink.id != state[j].vs[k].link.id) {
-                        connection = 0;
-                        break;
-                    }
-                }
-                if (!connection) {
-                    p[n4 * i + j] = 0.0; //遷移先のリンク以外へは遷移しない
-                    //puts("2"); //
-                    continue;
-                }
-                
-                cond1 = 1;
-                out = 0;
-                for (k = 0; k < VNUMBER; k++) {
-                    for (l = 0; l < n2; l++) {
-                        if (action[i].va[k].x[l] == 1 && state[j].vs[k].sf[l] != 2) {
-                            cond1 = 0;
-                            out = 1;
-                            break;
-                        }
-                    }
-                    if (out) {
-                        break;
-                    }
-                }
-                if (!cond1) {
-                    p[n4 * i + j] = 0.0;
-                    //puts("3"); //
-                    continue;
-                }
-                
-                cond2 = 1;
-                out = 0;
-                for (k = 0; k < VNUMBER; k++) {
-                    for (l = 0; l < n2; l++) {
-                        if (action[i].nowstate.vs[k].sf[l] == 1 && action[i].va[k].x[l] == 0 && state[j].vs[k].sf[l] != 0) {
-                            cond2 = 0;
-                            out = 1;
-                            break;
-                        }
-                    }
-                    if (out) {
-                        break;
-                    }
-                }
-                if (!cond2) {
-                    p[n4 * i + j] = 0.0;
-                    //puts("4"); //
-                    continue;
-                }
-                
-                cond3 = 1;
-                cond4 = 1;
-                cond5 = 1;
-                cond6 = 1;
-                out = 0;
-                for (k = 0; k < VNUMBER; k++) {
-                    for (l = 0; l < n2; l++) {
-                        onum = -1;
-                        dnum = -1;
-                        for (m = 0; m < n3; m++) {
-                            if (link[m].id == (demand[l].o / 10) * 1000 + (demand[l].o % 10) * 10) {
-                                onum = m;
-                            }
-                            if (link[m].id == (demand[l].d / 10) * 1000 + (demand[l].d % 10) * 10) {
-                                dnum = m;
-                            }
-                        }
-                        if (onum == -1 || dnum == -1) {
-                            puts("onumまたはdnumが見つかりません．");
-                            exit(EXIT_FAILURE);
-                        }
-                        
-                        if (action[i].nowstate.vs[k].sf[l] == 2 && action[i].va[k].nextlink.o == link[onum].d && state[j].vs[k].sf[l] != 3) {
-                            cond3 = 0;
-                            out = 1;
-                            //puts("5"); //
-                            break;
-                        }
-                        if (action[i].nowstate.vs[k].sf[l] == 2 && action[i].va[k].nextlink.o != link[onum].d && state[j].vs[k].sf[l] != 2) {
-                            cond4 = 0;
-                            out = 1;
-                            //puts("6"); //
-                            break;
-                        }
-                        if (action[i].nowstate.vs[k].sf[l] == 3 && action[i].nowstate.vs[k].link.d == link[dnum].o && state[j].vs[k].sf[l] != 0) {
-                            cond5 = 0;
-                            out = 1;
-                            //puts("7"); //
-                            break;
-                        }
-                        if (action[i].nowstate.vs[k].sf[l] == 3 && action[i].nowstate.vs[k].link.d != link[dnum].o && state[j].vs[k].sf[l] != 3) {
-                            cond6 = 0;
-                            out = 1;
-                            //puts("8"); //
-                            break;
-                        }
-                    }
-                    if (out) {
-                        break;
-                    }
-                }
-                if (!cond3 || !cond4 || !cond5 || !cond6) {
-                    p[n4 * i + j] = 0.0;
-                    continue;
-                }
-                
-                out = 0;
-                for (k = 0; k < n2; k++) {
-                    for (l = 0; l < VNUMBER; l++) {
-                        if (action[i].nowstate.vs[l].sf[k] == 0 && (state[j].vs[l].sf[k] == 2 || state[j].vs[l].sf[k] == 3)) {
-                            p[n4 * i + j] = 0.0;
-                            out = 1;
-                            break;
-                        }
-                    }
-                    if (out) {
-                        break;
-                    }
-                    
-                    if (state[j].vs[0].sf[k] == 1) { //この時点で(0,...,0)から(1,...,1)への遷移であることは確定する
-                        p[n4 * i + j] *= P[(Tmax + 1) * k + state[j].t];
-                    }
-
-                    all_zero = 1;
-                    for (l = 0; l < VNUMBER; l++) {
-                        if (action[i].nowstate.vs[l].sf[k] != 0) {
-                            all_zero = 0;
-                            break;
-                        }
-                    }
-                    
-                    if (all_zero && state[j].vs[0].sf[k] == 0) {
-                        p[n4 * i + j] *= (1 - P[(Tmax + 1) * k + state[j].t]);
-                    }
-                }
-                if (out) {
-                    continue;
-                }
-                //puts("a");
-                
-                sum += p[n4 * i + j];
-            }
-            //printf("行動%lluの状態遷移確率格納完了\n", i);
-//            if ((int)sum != 1 && sum != 1.0) {
-//                printf("行動%lluにおいて合計値が%fになっています\n", i, sum);
-//                for (j = 0; j < n4; j++) {
-//                    if (p[n4 * i + j] > 0) {
-//                        printf("p[%llu][%llu] = %f\n", i, j, p[n4 * i + j]);
-//                        printf("t = %d\n", state[j].t);
-//                        for (k = 0; k < VNUMBER; k++) {
-//                            printf("l_%d = %d\n", k, state[j].vs[k].link.id);
-//                            for (l = 0; l < n2; l++) {
-//                                printf("sf_%d%d = %u\n", k, l, state[j].vs[k].sf[l]);
-//                            }
-//                        }
-//                    }
-//                }
-//            }
+    unsigned long long *tmp_statenum;
+    Prob *tmp_prob;
+
+    if (p->nnz == p->size) {
+        p->size = (p->size == 0) ? 1024 : p->size * 2;
+        tmp_statenum = (unsigned long long *)realloc(p->statenum, sizeof(unsigned long long) * p->size);
+        tmp_prob = (Prob *)realloc(p->prob, sizeof(Prob) * p->size);
+        if (tmp_statenum == NULL || tmp_prob == NULL) {
+            puts("状態遷移確率のメモリ確保に失敗しました．");
+            exit(EXIT_FAILURE);
         }
+        p->statenum = tmp_statenum;
+        p->prob = tmp_prob;
     }
-    
+
+    p->statenum[p->nnz] = statenum;
+    p->prob[p->nnz] = prob;
+    p->nnz++;
+
     return;
 }
 
-/*こっちはt=0にどの状態を取るかの確率を求めるために必要*/
-void grl_assignment2(Network *link2, int n1, Demand *demand, int n2, Network *link, int n3, State state, double *P)
+/*行動をとったときに遷移しうる次の状態だけを直接生成し，状態遷移確率とともにpに追加する*/
+/*sfは車両数×OD数，branchはOD数の作業領域．遷移先が存在しない（容量制約違反などの）場合は何も追加せず0を返す*/
+/*PがNULLなら入札の有無の全ての組み合わせを確率1として追加する（到達可能性の判定用）*/
+int get_next_states(Action action, State *state, unsigned long long *layer, Demand *demand, int n2, Network *link, int n3, double *P, unsigned short *sf, int *branch, Trans *p)
 {
-    int i, j, t;
-    int num1; //デマンド交通リンクの本数
-    int num2; //待ちリンクの本数
-    int N; //link3の要素数
-    int idmax = INT_MAX; //変えないこと
-    int nidmax = INT_MAX;
+    int i, k, b;
+    int nb; //入札するかどうかで分岐する需要の数
     int onum, dnum;
-    double tmp;
-    Network link3[256];
-    double pr[2048];
+    int linknum[VNUMBER];
+    unsigned t;
+    unsigned short all_zero;
+    unsigned long long c, next, start;
+    double prob;
 
-    for (i = 0; i < n2; i++) { //全ての需要についての繰り返し
-        /*----------デマンド交通リンクと待ちリンクを追加してリンクデータを完成----------*/
-        num1 = (int)(demand[i].e * (dijkstra((demand[i].o / 10) * 1000 + (demand[i].o % 10) * 10, (demand[i].d / 10) * 1000 + (demand[i].d % 10) * 10, link, n3) - 1));
-        
-        tmp = 0.0;
-        for (j = 0; j < VNUMBER; j++) {
-            tmp += demand[i].e * dijkstra(state.vs[j].link.id, (demand[i].o / 10) * 1000 + (demand[i].o % 10) * 10, link, n3);
+    t = action.nowstate.t + 1;
+    start = p->nnz; //失敗したときに途中まで追加した遷移先を取り消す
+
+    for (i = 0; i < VNUMBER; i++) {
+        linknum[i] = action.va[i].nextlink.num;
+    }
+
+    /*決定的に決まる次の入札状況*/
+    nb = 0;
+    for (k = 0; k < n2; k++) {
+        onum = demand[k].onum;
+        dnum = demand[k].dnum;
+
+        all_zero = 1;
+        for (i = 0; i < VNUMBER; i++) {
+            switch (get_sf(&action.nowstate, i, k)) {
+                case 1: //受理されれば2，されなければ0
+                    sf[n2 * i + k] = action.va[i].x[k] ? 2 : 0;
+                    all_zero = 0;
+                    break;
+                case 2: //出発地に着いたら乗車
+                    sf[n2 * i + k] = (action.va[i].nextlink.o == link[onum].d) ? 3 : 2;
+                    all_zero = 0;
+                    break;
+                case 3: //目的地に着いたら降車
+                    sf[n2 * i + k] = (link[get_link(&action.nowstate, i)].d == link[dnum].o) ? 0 : 3;
+                    all_zero = 0;
+                    break;
+                default:
+                    sf[n2 * i + k] = 0;
+                    break;
+            }
         }
-        tmp /= VNUMBER;
-        if (tmp <= 1) {
-            num2 = 1;
-        } else {
-            num2 = tmp - 1;
+
+        if (all_zero && t == demand[k].tb - 1) {
+            branch[nb] = k; //入札する(1,...,1)かしない(0,...,0)かの2通り
+            nb++;
         }
-        
-        N = n1 + num1 + num2;
-//        link3 = (Network *)realloc(link3, sizeof(Network) * N);
-//        pr = (double * )realloc(pr, sizeof(double) * N * N * (Tmax + 1));
-//        if (link3 == NULL || pr == NULL) {
-//            puts("メモリ不足7");
-//            exit(EXIT_FAILURE);
-//        }
+    }
+    if (nb >= 64) {
+        puts("分岐する需要が多すぎます．");
+        exit(EXIT_FAILURE);
+    }
 
-        onum = -1;
-        dnum = -1;
-        for (j = 0; j < n1; j++) {
-            if (link2[j].id == demand[i].o) {
-                onum = j;
-            }
-            if (link2[j].id == demand[i].d) {
-                dnum = j;
+    /*入札の有無の組み合わせごとに遷移先を生成（配列番号の昇順になる）*/
+    for (c = 0; c < (1ULL << nb); c++) {
+        for (b = 0; b < nb; b++) {
+            for (i = 0; i < VNUMBER; i++) {
+                sf[n2 * i + branch[b]] = (c >> (nb - 1 - b)) & 1;
             }
         }
-        if (onum == -1 || dnum == -1) {
-            puts("onumまたはdnumが見つかりません．");
-            exit(EXIT_FAILURE);
-        }
 
-        /*デマンド交通リンク以外はlink2の複製で良い・ついでに即時効用の格納*/
-        for (j = 0; j < n1; j++) {
-            link3[j] = link2[j];
-            for (t = 0; t <= Tmax; t++) {
-                link3[j].v[t] = demand[i].beta_time * STEPTIME + demand[i].beta_fare * link3[j].f;
+        prob = 1.0;
+        for (k = 0; k < n2 && P != NULL; k++) {
+            if (sf[k] == 1) {
+                prob *= P[(Tmax + 1) * k + t];
+                continue;
             }
-            if (link3[j].o != link3[j].d) {
-                link3[j].v[demand[i].tb - 1] = -DBL_MAX;
+
+            all_zero = 1;
+            for (i = 0; i < VNUMBER; i++) {
+                if (get_sf(&action.nowstate, i, k) != 0) {
+                    all_zero = 0;
+                    break;
+                }
+            }
+            if (all_zero) {
+                prob *= (1 - P[(Tmax + 1) * k + t]);
             }
         }
-        
-        /*デマンド交通のネットワーク*/
-        link3[n1].id = idmax - num1 + 1;
-        link3[n1].o = -nidmax;
-        link3[n1].d = nidmax - num1 + 1;
-        for (t = 0; t <= Tmax; t++) { //1本目
-            link3[n1].v[t] = demand[i].beta_time * STEPTIME; //料金は先払いなので時間のみ
+
+        next = get_state_number(t, linknum, sf, state, layer, demand, n2, n3);
+        if (next == -1) {
+            p->nnz = start; //行を空に戻す
+            return 0; //乗車人数は入札の有無によらないので，容量制約違反なら他の遷移先も全て違反（終端時刻の状態は容量を超えても列挙しているので，違反になるのはt < Tmaxのみ）
         }
-        if (num1 == 1) {
-            link3[n1].d = link3[dnum].o;
+        if (prob > 0.0) {
+            add_trans(p, next, prob); //非ゼロ要素のみ格納
         }
-        
-        for (j = n1 + 1; j < n1 + num1; j++) { //2本目以降
-            link3[j].id = link3[j - 1].id + 1;
-            link3[j].o = link3[j - 1].d;
-            if (j != n1 + num1 - 1) {
-                link3[j].d = link3[j - 1].d + 1;
-            } else {
-                link3[j].d = link3[dnum].o;
+    }
+
+    return 1;
+}
+
+/*初期状態（first_p > 0）から到達可能な状態とその行動だけを残し，配列を前に詰める*/
+/*n1は状態数，n2は行動数，n3は初期状態数で，いずれも詰めた後の数に更新する*/
+void prune_unreachable(State *state, unsigned long long *n1, unsigned long long *layer, Action *action, unsigned long long *n2, double *first_p, unsigned long long *n3, Demand *demand, int n4, Network *link, int n5)
+{
+    unsigned long long i, j, a, e, first, count, acount, fcount;
+    int v;
+    unsigned t;
+    unsigned short *reach;
+    unsigned long long before[Tmax + 1];
+    unsigned short *sf;
+    int *branch;
+    Trans next; //到達可能な遷移先を一時的に格納
+
+    reach = (unsigned short *)calloc(*n1, sizeof(unsigned short));
+    sf = (unsigned short *)malloc(sizeof(unsigned short) * VNUMBER * n4);
+    branch = (int *)malloc(sizeof(int) * n4);
+    if (reach == NULL || sf == NULL || branch == NULL) {
+        puts("到達可能性判定用のメモリ確保に失敗しました．");
+        exit(EXIT_FAILURE);
+    }
+    next.offset = NULL;
+    next.statenum = NULL;
+    next.prob = NULL;
+    next.size = 0;
+
+    /*前向きに到達可能な状態に印をつける*/
+    for (i = layer[0]; i < layer[1]; i++) {
+        if (first_p[i - layer[0]] > 0) {
+            reach[i] = 1;
+        }
+    }
+    for (t = 0; t < Tmax; t++) {
+        for (i = layer[t]; i < layer[t + 1]; i++) {
+            if (!reach[i]) {
+                continue;
             }
-            
-            for (t = 0; t < Tmax; t++) {
-                link3[j].v[t] = demand[i].beta_time * STEPTIME; //料金は先払いなので時間のみ
+            for (a = state[i].firstaction; a < state[i].firstaction + state[i].numaction; a++) {
+                if (!action[a].presence || action[a].r < -DBL_MAX / 2) {
+                    continue; //とれない行動からは遷移しない
+                }
+                next.nnz = 0;
+                if (!get_next_states(action[a], state, layer, demand, n4, link, n5, NULL, sf, branch, &next)) {
+                    action[a].r = -DBL_MAX; //容量制約に違反する行動はとれない
+                    continue;
+                }
+                for (e = 0; e < next.nnz; e++) {
+                    reach[next.statenum[e]] = 1;
+                }
             }
         }
-        
-        /*待ちリンク*/
-        link3[n1 + num1].id = idmax - num1 - num2 + 1;
-        link3[n1 + num1].o = link3[onum].d;
-        link3[n1 + num1].d = nidmax - num1 - num2 + 1;
-        for (t = 0; t < Tmax; t++) { //1本目
-            if (t == demand[i].tb - 1) {
-                link3[n1 + num1].v[t] = demand[i].beta_time * STEPTIME + demand[i].beta_fare * (F0 + F * num1) + demand[i].beta_exp; //料金は先払い・経験による信頼度も含めて判断
-            } else {
-                link3[n1 + num1].v[t] = -DBL_MAX;
+    }
+
+    /*到達可能な状態・行動・初期状態の確率を前に詰める*/
+    for (t = 0; t <= Tmax; t++) {
+        before[t] = layer[t + 1] - layer[t];
+    }
+    count = 0;
+    acount = 0;
+    fcount = 0;
+    for (t = 0; t <= Tmax; t++) {
+        i = layer[t];
+        j = layer[t + 1];
+        layer[t] = count;
+        for (; i < j; i++) {
+            if (!reach[i]) {
+                for (a = state[i].firstaction; a < state[i].firstaction + state[i].numaction; a++) {
+                    for (v = 0; v < VNUMBER; v++) {
+                        free(action[a].va[v].x);
+                    }
+                    free(action[a].va);
+                }
+                continue;
             }
-        }
-        if (num2 == 1) {
-            link3[n1 + num1].d = link3[n1].o;
-        }
-        
-        for (j = n1 + num1 + 1; j < n1 + num1 + num2; j++) { //2本目以降
-            link3[j].id = link3[j - 1].id + 1;
-            link3[j].o = link3[j - 1].d;
-            if (j != n1 + num1 + num2 - 1) {
-                link3[j].d = link3[j - 1].d + 1;
-            } else {
-                link3[j].d = link3[n1].o;
+            if (t == 0) {
+                first_p[fcount] = first_p[i];
+                fcount++;
             }
-            
-            for (t = 0; t < Tmax; t++) {
-                link3[j].v[t] = demand[i].beta_time * STEPTIME; //料金は先払いなので時間のみ
+
+            first = state[i].firstaction;
+            state[count] = state[i];
+            state[count].firstaction = acount;
+            for (a = first; a < first + state[count].numaction; a++) {
+                action[acount] = action[a];
+                action[acount].id = acount;
+                action[acount].nowstate = state[count];
+                acount++;
             }
+            count++;
         }
-        
-        /*--------------------ここからgRLで配分--------------------*/
-        /*指示関数の決定*/
-        get_I(link3, N, demand[i]);
+    }
+    layer[Tmax + 1] = count;
 
-        /*期待最大効用を求める*/
-        backward_induction_for_grl(link3, N, demand[i], num2);
+    puts("到達可能な状態数（時刻ごと）");
+    for (t = 0; t <= Tmax; t++) {
+        printf("t = %u：%llu → %llu（%llu削減）\n", t, before[t], layer[t + 1] - layer[t], before[t] - (layer[t + 1] - layer[t]));
+    }
+    printf("状態数：%llu → %llu\n", *n1, count);
+    printf("行動数：%llu → %llu\n", *n2, acount);
 
-        /*遷移確率行列を求める*/
-        get_prob_matrix(link3, N, demand[i], pr);
+    *n1 = count;
+    *n2 = acount;
+    *n3 = fcount;
 
-        /*入札確率を格納*/
-        for (t = 0; t <= Tmax; t++) {
-            if (t == demand[i].tb - 1) {
-                P[(Tmax + 1) * i + t] = pr[N * N * t + N * onum + n1 + num1];
-                //printf("%f\n", P[(Tmax + 1) * i + t]);
-                //if (P[(Tmax + 1) * i + t] == 0) {
-                //    printf("個人%d，時刻%dで", i, t);
-                //    puts("入札確率が0です．");
-                //}
-//                printf("P[%d][%d] = %f\n", i, t, P[(Tmax + 1) * i + t]);
-            } else {
-                P[(Tmax + 1) * i + t] = 0;
+    free(reach);
+    free(sf);
+    free(branch);
+    free(next.statenum);
+    free(next.prob);
+
+    return;
+}
+
+/*状態遷移確率の計算*/
+void get_state_trans_prob(Grl_Net *net, Demand *demand, int n2, Network *link, int n3, State *state, unsigned long long n4, unsigned long long *layer, Action *action, unsigned long long n5, Trans *p, double *P, int *hop)
+{
+    unsigned long long i;
+    unsigned short *sf;
+    int *branch;
+
+    sf = (unsigned short *)malloc(sizeof(unsigned short) * VNUMBER * n2);
+    branch = (int *)malloc(sizeof(int) * n2);
+    if (sf == NULL || branch == NULL) {
+        puts("遷移先生成用の作業領域の確保に失敗しました．");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < n5; i++) {
+//        /*強制終了対策でスリープさせる*/
+//        for (deno = 1; deno <= DENO; deno++) {
+//            if (i == deno * n5 / DENO) {
+//                sleep(5);
+//            }
+//        }
+        
+        p->offset[i] = p->nnz;
+
+        if (action[i].presence) {
+            grl_assignment(net, demand, n2, n3, action[i], P, hop); //行動に対する入札確率を求める
+            if (!get_next_states(action[i], state, layer, demand, n2, link, n3, P, sf, branch, p)) { //到達可能な次の状態のみ生成
+                action[i].r = -DBL_MAX; //容量制約に違反する行動はとれない
             }
         }
     }
+    p->offset[n5] = p->nnz;
     
+    printf("状態遷移確率の非ゼロ要素数：%llu\n", p->nnz);
+
+    free(sf);
+    free(branch);
+
+    return;
+}
+
+/*こっちはt=0にどの状態を取るかの確率を求めるために必要（待ちリンクの効用に定数項を入れない）*/
+void grl_assignment2(Grl_Net *net, Demand *demand, int n2, int n3, State state, double *P, int *hop)
+{
+    int j;
+    int vlink[VNUMBER]; //車両のリンクの配列番号
+
+    for (j = 0; j < VNUMBER; j++) {
+        vlink[j] = get_link(&state, j);
+    }
+    get_bid(net, demand, n2, n3, vlink, 0, P, hop);
+
     return;
 }
 
 /*最初の状態の確率*/
-void first_state_prob(State *state, unsigned long long n1, double *first_p, unsigned long long n2, Network *link, int n3, Demand *demand, int n4, Network *link2, int n5, double *P)
+void first_state_prob(State *state, unsigned long long n1, unsigned long long *layer, double *first_p, unsigned long long n2, Network *link, int n3, Demand *demand, int n4, Grl_Net *net, double *P, int *hop)
 {
     unsigned long long j, count;
     int k;
@@ -1784,20 +2536,18 @@ void first_state_prob(State *state, unsigned long long n1, double *first_p, unsi
     
     count = 0;
     sum = 0.0;
-    for (j = 0; j < n1; j++) {
-        if (state[j].t == 0) {
-            first_p[count] = 1.0 / (double)pow(n3, VNUMBER);
-            grl_assignment2(link2, n5, demand, n4, link, n3, state[j], P);
-            for (k = 0; k < n4; k++) {
-                if (state[j].vs[0].sf[k] == 0) {
-                    first_p[count] *= 1 - P[(Tmax + 1) * k];
-                } else if (state[j].vs[0].sf[k] == 1) {
-                    first_p[count] *= P[(Tmax + 1) * k];
-                }
+    for (j = layer[0]; j < layer[1]; j++) { //t=0の状態のみ
+        first_p[count] = 1.0 / (double)pow(n3, VNUMBER);
+        grl_assignment2(net, demand, n4, n3, state[j], P, hop);
+        for (k = 0; k < n4; k++) {
+            if (get_sf(&state[j], 0, k) == 0) {
+                first_p[count] *= 1 - P[(Tmax + 1) * k];
+            } else if (get_sf(&state[j], 0, k) == 1) {
+                first_p[count] *= P[(Tmax + 1) * k];
             }
-            sum += first_p[count];
-            count++;
         }
+        sum += first_p[count];
+        count++;
     }
     
     if (count != n2) {
@@ -1815,9 +2565,9 @@ void first_state_prob(State *state, unsigned long long n1, double *first_p, unsi
 }
 
 /*後ろ向き帰納法*/
-void backward_induction(State *state, Policy *pi, unsigned long long n1, Action *action, unsigned long long n2, double *p, double gamma)
+void backward_induction(State *state, Policy *pi, unsigned long long n1, unsigned long long *layer, Action *action, unsigned long long n2, Trans *p, double gamma)
 {
-    unsigned long long i, j, k;
+    unsigned long long i, j, k, e;
     unsigned t;
     double tmp_max, ex_V;
     double max;
@@ -1835,189 +2585,1057 @@ void backward_induction(State *state, Policy *pi, unsigned long long n1, Action
         
 //        printf("t = %u\n", t); //追加
         
-        for (i = 0; i < n1; i++) {
-            if (state[i].t == t) {
-                max = -DBL_MAX;
-                opt_act = -1;
-                
-                for (j = 0; j < n2; j++) {
-                    if (action[j].nowstate.id == state[i].id) {
-                        ex_V = 0;
-                        for (k = 0; k < n1; k++) {
-                            if (state[k].V < -DBL_MAX / 2) {
-                                ex_V += p[n1 * j + k] * state[k].V; //こうすることで近視眼的に行動をとっても制約条件は守られる
-                            } else {
-                                ex_V += p[n1 * j + k] * gamma * state[k].V;
-                            }
-//                            printf("p = %f\n", p[n1 * j + k]);
+        /*時刻tの状態は時刻t+1の状態価値しか参照しないので，状態ごとに並列に計算できる（状態ごとの計算順は逐次と同じなので結果も同じ）*/
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(use_threads()) private(j, k, e, tmp_max, ex_V, max, opt_act) schedule(dynamic, 64)
+#endif
+        for (i = layer[t]; i < layer[t + 1]; i++) { //時刻tの状態のみ
+            max = -DBL_MAX;
+            opt_act = -1;
+            
+            for (j = state[i].firstaction; j < state[i].firstaction + state[i].numaction; j++) { //状態iの行動のみ
+                ex_V = 0;
+                for (e = p->offset[j]; e < p->offset[j + 1]; e++) {
+                    k = p->statenum[e];
+                    if (state[k].V < -DBL_MAX / 2) {
+                        ex_V += p->prob[e] * state[k].V; //こうすることで近視眼的に行動をとっても制約条件は守られる
+                    } else {
+                        ex_V += p->prob[e] * gamma * state[k].V;
+                    }
+//                            printf("p = %f\n", p->prob[e]);
 //                            printf("state.V = %f\n", state[k].V);
 //                            printf("ex_V = %f\n", ex_V); //追加
-                        }
-                        tmp_max = action[j].r + ex_V;
+                }
+                tmp_max = action[j].r + ex_V;
 //                        if (i == 1231) {
 //                            printf("action[%llu].r = %f\n", j, action[j].r);
 //                            printf("ex_V = %f\n", ex_V);
 //                            printf("tmp_max = %f\n", tmp_max); //追加
 //                        }
-                        
-                        if (tmp_max > max) {
-                            max = tmp_max;
-                            opt_act = j;
-                        }
-                    }
+                
+                if (tmp_max > max) {
+                    max = tmp_max;
+                    opt_act = j;
                 }
-                if (opt_act == -1) {
+            }
+            if (opt_act == -1) {
 //                    printf("状態%lluにおいて最適行動がありません．\n", i);
-                    for (j = 0; j < n2; j++) {
-                        if (action[j].nowstate.id == state[i].id) {
-                            opt_act = j;
-                            break;
-                        }
-                    }
-                }
-                
-                state[i].V = max;
+                opt_act = state[i].firstaction;
+            }
+            
+            state[i].V = max;
 //                printf("state[%llu].V = %f\n", i, state[i].V); //追加
 //                printf("pi[%llu].action.r = %f\n", i, pi[i].action.r); //追加
-                pi[i].action = action[opt_act];
-                pi[i].actionnum = opt_act;
+            pi[i].action = action[opt_act];
+            pi[i].actionnum = opt_act;
+        }
+//        putchar('\n'); //追加
+    }
+    
+//    for (i = 0; i < n1; i++) {
+//        if (state[i].t == 3) {
+//            printf("pi[%llu].action.nowstate.t = %u\n", i, pi[i].action.nowstate.t); //追加
+//        }
+//    }
+    
+    return;
+}
+
+/*経過時間の計測用の時刻（秒）*/
+double wall_time(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*反復計算の経過の書き出しを始める（TELEMETRYが0なら何もしない）*/
+void open_telemetry(Telemetry *tm, char *out_telemetry, char *solver)
+{
+    tm->fp = NULL;
+    tm->solver = solver;
+    tm->start = wall_time();
+    tm->last = tm->start;
+
+    if (!TELEMETRY) {
+        return;
+    }
+
+    tm->fp = fopen(out_telemetry, "w");
+    if (tm->fp == NULL) {
+        printf("ファイル%sが開けません．\n", out_telemetry);
+        exit(EXIT_FAILURE);
+    }
+    fprintf(tm->fp, "solver,iteration,residual,policy_changes,sweep_sec,backups,backups_per_sec,elapsed_sec\n"); //1行目
+
+    return;
+}
+
+/*繰り返し1回分の経過を1行書き出す．changesは方策が変わった状態数（数えない解法は負の値で空欄）*/
+void write_telemetry(Telemetry *tm, unsigned long long iteration, double residual, long long changes, unsigned long long backups)
+{
+    double now, sec;
+
+    if (tm->fp == NULL) {
+        return;
+    }
+
+    now = wall_time();
+    sec = now - tm->last;
+    tm->last = now;
+
+    fprintf(tm->fp, "%s,%llu,%.10g,", tm->solver, iteration, residual);
+    if (changes >= 0) {
+        fprintf(tm->fp, "%lld", changes);
+    }
+    fprintf(tm->fp, ",%f,%llu,%.1f,%f\n", sec, backups, (sec > 0) ? backups / sec : 0.0, now - tm->start);
+    fflush(tm->fp); //途中で止まっていないかを外から確認できるように
+
+    return;
+}
+
+/*反復計算の経過の書き出しを終える*/
+void close_telemetry(Telemetry *tm)
+{
+    if (tm->fp != NULL) {
+        fclose(tm->fp);
+        tm->fp = NULL;
+    }
+
+    return;
+}
+
+/*チェックポイントを書き出す時刻になったか（前回からCHECKPOINT_SEC秒以上経過したら1を返してlastを更新）*/
+int checkpoint_due(time_t *last)
+{
+    if (CHECKPOINT_SEC > 0 && difftime(time(NULL), *last) >= CHECKPOINT_SEC) {
+        *last = time(NULL);
+        return 1;
+    }
+
+    return 0;
+}
+
+/*hにsizeバイトのdataを加えたFNV-1aハッシュを返す*/
+unsigned long long fnv_hash(unsigned long long h, const void *data, size_t size)
+{
+    size_t i;
+    const unsigned char *c = (const unsigned char *)data;
+
+    for (i = 0; i < size; i++) {
+        h = (h ^ c[i]) * 1099511628211ULL;
+    }
+
+    return h;
+}
+
+/*チェックポイントが依存する入力データのハッシュ．リンク・需要のデータと運賃・gRLの定数，そこから求めた入札確率の表・初期状態の確率・即時報酬を含める*/
+/*即時報酬は容量制約で-DBL_MAXにする前（状態遷移確率を計算する前）の値を使うこと*/
+unsigned long long model_hash(Network *link, int n1, Network *link2, int n2, Demand *demand, int n3, Grl_Net *net, double *first_p, unsigned long long n4, Action *action, unsigned long long n5)
+{
+    int i, count;
+    unsigned long long j;
+    unsigned long long h = 14695981039346656037ULL;
+    double constant[] = {b_service, mu, beta, F0, F, STEPTIME};
+
+    h = fnv_hash(h, constant, sizeof(constant));
+    for (i = 0; i < n1; i++) {
+        h = fnv_hash(h, &link[i].id, sizeof(int));
+        h = fnv_hash(h, &link[i].o, sizeof(int));
+        h = fnv_hash(h, &link[i].d, sizeof(int));
+        h = fnv_hash(h, &link[i].c, sizeof(double));
+    }
+    for (i = 0; i < n2; i++) {
+        h = fnv_hash(h, &link2[i].id, sizeof(int));
+        h = fnv_hash(h, &link2[i].o, sizeof(int));
+        h = fnv_hash(h, &link2[i].d, sizeof(int));
+        h = fnv_hash(h, &link2[i].f, sizeof(unsigned));
+    }
+    for (i = 0; i < n3; i++) {
+        h = fnv_hash(h, &demand[i].id, sizeof(int));
+        h = fnv_hash(h, &demand[i].o, sizeof(int));
+        h = fnv_hash(h, &demand[i].d, sizeof(int));
+        h = fnv_hash(h, &demand[i].tb, sizeof(unsigned));
+        h = fnv_hash(h, &demand[i].te, sizeof(unsigned));
+        h = fnv_hash(h, &demand[i].e, sizeof(double));
+        h = fnv_hash(h, &demand[i].beta_time, sizeof(double));
+        h = fnv_hash(h, &demand[i].beta_fare, sizeof(double));
+        h = fnv_hash(h, &demand[i].beta_t, sizeof(double));
+        h = fnv_hash(h, &demand[i].beta_exp, sizeof(double));
+    }
+
+    count = (n3 > 0) ? net->bidstart[n3 - 1] + net->maxnum2[n3 - 1] : 0;
+    h = fnv_hash(h, net->bid, sizeof(double) * WAIT_CONSTS * count);
+    h = fnv_hash(h, first_p, sizeof(double) * n4);
+    for (j = 0; j < n5; j++) {
+        h = fnv_hash(h, &action[j].r, sizeof(double));
+    }
+
+    return h;
+}
+
+/*チェックポイントのヘッダを作る．入力データのハッシュmodelに状態の並びを加える*/
+void set_ckpt_header(Ckpt_Header *h, State *state, unsigned long long n1, unsigned long long model)
+{
+    unsigned long long i, x;
+
+    h->tmax = Tmax;
+    h->vnumber = VNUMBER;
+    h->capacity = CAPACITY;
+    h->float_prob = FLOAT_PROB;
+    h->hash = model;
+    for (i = 0; i < n1; i++) {
+        h->hash = fnv_hash(h->hash, state[i].key, sizeof(unsigned long long) * KEYWORDS);
+        x = state[i].t;
+        h->hash = fnv_hash(h->hash, &x, sizeof(x));
+        x = state[i].numaction;
+        h->hash = fnv_hash(h->hash, &x, sizeof(x));
+    }
+
+    return;
+}
+
+/*チェックポイントのヘッダを読み，今の計算と一致すれば1を返す*/
+int read_ckpt_header(FILE *fp, State *state, unsigned long long n1, unsigned long long model)
+{
+    Ckpt_Header h, now;
+
+    set_ckpt_header(&now, state, n1, model);
+    if (fread(&h, sizeof(Ckpt_Header), 1, fp) != 1) {
+        return 0;
+    }
+
+    return h.tmax == now.tmax && h.vnumber == now.vnumber && h.capacity == now.capacity && h.float_prob == now.float_prob && h.hash == now.hash;
+}
+
+/*状態遷移確率（と容量制約で-DBL_MAXにした即時報酬）をチェックポイントとして書き出す（一時ファイルに書いてから置き換える）*/
+void save_trans(Trans *p, State *state, Action *action, unsigned long long n1, unsigned long long n2, char *checkpoint, unsigned long long model)
+{
+    unsigned long long i;
+    int prob_size = sizeof(Prob);
+    char tmp[FILENAME_MAX];
+    Ckpt_Header h;
+    FILE *fp;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", checkpoint);
+    fp = fopen(tmp, "wb");
+    if (fp == NULL) {
+        printf("ファイル%sが開けません．\n", tmp);
+        exit(EXIT_FAILURE);
+    }
+
+    set_ckpt_header(&h, state, n1, model);
+    fwrite(&h, sizeof(Ckpt_Header), 1, fp);
+    fwrite(&prob_size, sizeof(int), 1, fp);
+    fwrite(&n1, sizeof(unsigned long long), 1, fp);
+    fwrite(&n2, sizeof(unsigned long long), 1, fp);
+    fwrite(&p->nnz, sizeof(unsigned long long), 1, fp);
+    fwrite(p->offset, sizeof(unsigned long long), n2 + 1, fp);
+    fwrite(p->statenum, sizeof(unsigned long long), p->nnz, fp);
+    fwrite(p->prob, sizeof(Prob), p->nnz, fp);
+    for (i = 0; i < n2; i++) {
+        fwrite(&action[i].r, sizeof(double), 1, fp);
+    }
+
+    if (fclose(fp) != 0 || rename(tmp, checkpoint) != 0) {
+        printf("ファイル%sに書き出せません．\n", checkpoint);
+        exit(EXIT_FAILURE);
+    }
+
+    return;
+}
+
+/*チェックポイントから状態遷移確率を読み込む．ヘッダ・状態数・行動数・型が一致すれば1を返す*/
+int load_trans(Trans *p, State *state, Action *action, unsigned long long n1, unsigned long long n2, char *checkpoint, unsigned long long model)
+{
+    unsigned long long i, m1, m2, nnz;
+    int prob_size;
+    FILE *fp;
+
+    fp = fopen(checkpoint, "rb");
+    if (fp == NULL) {
+        return 0;
+    }
+
+    if (!read_ckpt_header(fp, state, n1, model) || fread(&prob_size, sizeof(int), 1, fp) != 1 || fread(&m1, sizeof(unsigned long long), 1, fp) != 1 || fread(&m2, sizeof(unsigned long long), 1, fp) != 1 || fread(&nnz, sizeof(unsigned long long), 1, fp) != 1 || prob_size != sizeof(Prob) || m1 != n1 || m2 != n2) {
+        printf("チェックポイント%sは条件が異なるので使いません．\n", checkpoint);
+        fclose(fp);
+        return 0;
+    }
+
+    p->statenum = (unsigned long long *)malloc(sizeof(unsigned long long) * (nnz + 1));
+    p->prob = (Prob *)malloc(sizeof(Prob) * (nnz + 1));
+    if (p->statenum == NULL || p->prob == NULL) {
+        puts("メモリ不足17.0");
+        exit(EXIT_FAILURE);
+    }
+    p->nnz = nnz;
+    p->size = nnz + 1;
+
+    if (fread(p->offset, sizeof(unsigned long long), n2 + 1, fp) != n2 + 1 || fread(p->statenum, sizeof(unsigned long long), nnz, fp) != nnz || fread(p->prob, sizeof(Prob), nnz, fp) != nnz) {
+        printf("チェックポイント%sが壊れています．\n", checkpoint);
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < n2; i++) {
+        if (fread(&action[i].r, sizeof(double), 1, fp) != 1) {
+            printf("チェックポイント%sが壊れています．\n", checkpoint);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    fclose(fp);
+
+    return 1;
+}
+
+/*ソルバーのチェックポイントを書き出す．状態価値関数・方策（行動の配列番号．piがNULLなら書かない）・繰り返し回数を一時ファイルに書いてから置き換える*/
+/*count2は方策評価の途中で書き出すときのその回のスイープ数（count回目の方策評価の途中）．それ以外は0*/
+void save_checkpoint(char *checkpoint, State *state, Policy *pi, unsigned long long n1, unsigned long long *layer, double gamma, unsigned long long count, unsigned long long count2, unsigned long long model)
+{
+    unsigned long long i;
+    int solution = SOLUTION;
+    int has_policy = (pi != NULL);
+    char tmp[FILENAME_MAX];
+    Ckpt_Header h;
+    FILE *fp;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", checkpoint);
+    fp = fopen(tmp, "wb");
+    if (fp == NULL) {
+        printf("ファイル%sが開けません．\n", tmp);
+        exit(EXIT_FAILURE);
+    }
+
+    set_ckpt_header(&h, state, n1, model);
+    fwrite(&h, sizeof(Ckpt_Header), 1, fp);
+    fwrite(&solution, sizeof(int), 1, fp);
+    fwrite(&gamma, sizeof(double), 1, fp);
+    fwrite(&n1, sizeof(unsigned long long), 1, fp);
+    fwrite(&count, sizeof(unsigned long long), 1, fp);
+    fwrite(&count2, sizeof(unsigned long long), 1, fp);
+    fwrite(&has_policy, sizeof(int), 1, fp);
+    for (i = 0; i < n1; i++) {
+        fwrite(&state[i].V, sizeof(double), 1, fp);
+    }
+    if (has_policy) {
+        for (i = 0; i < layer[Tmax]; i++) {
+            fwrite(&pi[i].actionnum, sizeof(unsigned long long), 1, fp);
+        }
+    }
+
+    if (fclose(fp) != 0 || rename(tmp, checkpoint) != 0) {
+        printf("ファイル%sに書き出せません．\n", checkpoint);
+        exit(EXIT_FAILURE);
+    }
+
+    return;
+}
+
+/*ソルバーのチェックポイントを読み込む．ヘッダ・解法・時間割引率・状態数が一致すれば状態価値関数と方策を戻し，繰り返し回数をcount・count2に入れて1を返す*/
+int load_checkpoint(char *checkpoint, State *state, Policy *pi, unsigned long long n1, unsigned long long *layer, Action *action, double gamma, unsigned long long *count, unsigned long long *count2, unsigned long long model)
+{
+    unsigned long long i, m1, c, c2, a;
+    int solution, has_policy;
+    double g;
+    FILE *fp;
+
+    fp = fopen(checkpoint, "rb");
+    if (fp == NULL) {
+        return 0;
+    }
+
+    if (!read_ckpt_header(fp, state, n1, model) || fread(&solution, sizeof(int), 1, fp) != 1 || fread(&g, sizeof(double), 1, fp) != 1 || fread(&m1, sizeof(unsigned long long), 1, fp) != 1 || fread(&c, sizeof(unsigned long long), 1, fp) != 1 || fread(&c2, sizeof(unsigned long long), 1, fp) != 1 || fread(&has_policy, sizeof(int), 1, fp) != 1 || solution != SOLUTION || g != gamma || m1 != n1 || has_policy != (pi != NULL)) {
+        printf("チェックポイント%sは条件が異なるので使いません．\n", checkpoint);
+        fclose(fp);
+        return 0;
+    }
+
+    for (i = 0; i < n1; i++) {
+        if (fread(&state[i].V, sizeof(double), 1, fp) != 1) {
+            printf("チェックポイント%sが壊れています．\n", checkpoint);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (has_policy) {
+        for (i = 0; i < layer[Tmax]; i++) {
+            if (fread(&a, sizeof(unsigned long long), 1, fp) != 1) {
+                printf("チェックポイント%sが壊れています．\n", checkpoint);
+                exit(EXIT_FAILURE);
+            }
+            pi[i].actionnum = a;
+            pi[i].action = action[a];
+        }
+    }
+    fclose(fp);
+
+    *count = c;
+    *count2 = c2;
+    if (c2 > 0) {
+        printf("チェックポイント%sから再開します（%llu回目の方策評価のスイープ%llu回目まで完了）\n", checkpoint, c, c2);
+    } else {
+        printf("チェックポイント%sから再開します（繰り返し処理%llu回目まで完了）\n", checkpoint, c);
+    }
+
+    return 1;
+}
+
+/*複数の時間割引率の後ろ向き帰納法をまとめて1回で行う．遷移確率は1回ずつ読み，全ての時間割引率に同時に適用する*/
+/*Vg・actgは[状態][時間割引率]の順に，ケースcの状態価値関数と最適行動の配列番号を格納する*/
+void backward_induction_multi(State *state, double *Vg, unsigned long long *actg, unsigned long long n1, unsigned long long *layer, Action *action, Trans *p, double *gamma, int ng)
+{
+    unsigned long long i, j, k, e;
+    unsigned t;
+    int c;
+    double ex_V[GAMMAS], max[GAMMAS], tmp_max, Vk;
+    unsigned long long opt_act[GAMMAS];
+
+    /*初期化*/
+    for (i = 0; i < n1 * ng; i++) {
+        Vg[i] = 0.0;
+    }
+    t = Tmax;
+
+    /*後ろ向き計算*/
+    while (t != 0) {
+        t--;
+
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(use_threads()) private(j, k, e, c, ex_V, max, tmp_max, Vk, opt_act) schedule(dynamic, 64)
+#endif
+        for (i = layer[t]; i < layer[t + 1]; i++) { //時刻tの状態のみ
+            for (c = 0; c < ng; c++) {
+                max[c] = -DBL_MAX;
+                opt_act[c] = -1;
+            }
+
+            for (j = state[i].firstaction; j < state[i].firstaction + state[i].numaction; j++) { //状態iの行動のみ
+                for (c = 0; c < ng; c++) {
+                    ex_V[c] = 0;
+                }
+                for (e = p->offset[j]; e < p->offset[j + 1]; e++) {
+                    k = p->statenum[e];
+                    for (c = 0; c < ng; c++) {
+                        Vk = Vg[ng * k + c];
+                        ex_V[c] += (Vk < -DBL_MAX / 2) ? p->prob[e] * Vk : p->prob[e] * gamma[c] * Vk; //制約違反は割り引かない
+                    }
+                }
+                for (c = 0; c < ng; c++) {
+                    tmp_max = action[j].r + ex_V[c];
+                    if (tmp_max > max[c]) {
+                        max[c] = tmp_max;
+                        opt_act[c] = j;
+                    }
+                }
+            }
+
+            for (c = 0; c < ng; c++) {
+                Vg[ng * i + c] = max[c];
+                actg[ng * i + c] = (opt_act[c] == -1) ? state[i].firstaction : opt_act[c];
+            }
+        }
+    }
+
+    return;
+}
+
+/*まとめて求めたケースcの結果を状態価値関数と最適方策に戻す*/
+void restore_case(State *state, Policy *pi, double *Vg, unsigned long long *actg, unsigned long long n1, unsigned long long *layer, Action *action, int ng, int c)
+{
+    unsigned long long i;
+
+    for (i = 0; i < n1; i++) {
+        state[i].V = Vg[ng * i + c];
+        if (i < layer[Tmax]) {
+            pi[i].action = action[actg[ng * i + c]];
+            pi[i].actionnum = actg[ng * i + c];
+        }
+    }
+
+    return;
+}
+
+/*方策評価のスイープ1回（方策piのもとでの状態価値関数をその場で更新する）．更新量の最大値を返す*/
+double evaluation_sweep(State *state, Policy *pi, unsigned long long *layer, Trans *p, double gamma, unsigned long long *backups)
+{
+    unsigned long long i, j, e;
+    double tmp_v;
+    double delta;
+
+    delta = 0;
+    for (i = 0; i < layer[Tmax]; i++) { //終端時刻以外の状態
+        tmp_v = state[i].V;
+        (*backups)++;
+
+        state[i].V = pi[i].action.r;
+        for (e = p->offset[pi[i].actionnum]; e < p->offset[pi[i].actionnum + 1]; e++) {
+            j = p->statenum[e];
+            if (state[j].V < -DBL_MAX / 2) {
+                state[i].V += p->prob[e] * state[j].V; //こうすることで近視眼的に行動するときでも制約条件がかかる
+            } else {
+                state[i].V += p->prob[e] * gamma * state[j].V;
+            }
+        }
+
+        if (tmp_v < -DBL_MAX / 2 && state[i].V < -DBL_MAX / 2) {
+            continue; //制約違反の状態同士の差は収束判定に含めない
+        }
+        delta = (delta > fabs(tmp_v - state[i].V)) ? delta : fabs(tmp_v - state[i].V);
+    }
+
+    return delta;
+}
+
+/*時刻の逆順に1回だけ計算する方策評価．遷移は必ず時刻tからt+1なので，これで厳密な値が求まる（後ろ向き帰納法と同じく時刻ごとに並列に計算する）*/
+void evaluate_dag(State *state, Policy *pi, unsigned long long *layer, Trans *p, double gamma, unsigned long long *backups)
+{
+    unsigned long long i, j, e;
+    unsigned t;
+    double V;
+
+    for (t = Tmax; t-- > 0;) {
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(use_threads()) private(j, e, V) schedule(dynamic, 64)
+#endif
+        for (i = layer[t]; i < layer[t + 1]; i++) {
+            V = pi[i].action.r;
+            for (e = p->offset[pi[i].actionnum]; e < p->offset[pi[i].actionnum + 1]; e++) {
+                j = p->statenum[e];
+                if (state[j].V < -DBL_MAX / 2) {
+                    V += p->prob[e] * state[j].V; //こうすることで近視眼的に行動するときでも制約条件がかかる
+                } else {
+                    V += p->prob[e] * gamma * state[j].V;
+                }
+            }
+            state[i].V = V;
+        }
+        *backups += layer[t + 1] - layer[t];
+    }
+
+    return;
+}
+
+/*y = (I - γP_π)x（linが1の状態のみ．遷移先は線形な状態か終端状態）．返り値は計算した行の数*/
+unsigned long long policy_matvec(Policy *pi, unsigned long long n, unsigned short *lin, Trans *p, double gamma, double *x, double *y)
+{
+    unsigned long long i, e, rows;
+
+    rows = 0;
+    for (i = 0; i < n; i++) {
+        if (!lin[i]) {
+            y[i] = 0;
+            continue;
+        }
+        rows++;
+        y[i] = x[i];
+        for (e = p->offset[pi[i].actionnum]; e < p->offset[pi[i].actionnum + 1]; e++) {
+            if (p->statenum[e] < n) { //終端状態の状態価値は0
+                y[i] -= gamma * p->prob[e] * x[p->statenum[e]];
+            }
+        }
+    }
+
+    return rows;
+}
+
+/*内積*/
+double dot(double *x, double *y, unsigned long long n)
+{
+    unsigned long long i;
+    double sum = 0;
+
+    for (i = 0; i < n; i++) {
+        sum += x[i] * y[i];
+    }
+
+    return sum;
+}
+
+/*BiCGSTABによる方策評価．(I - γP_π)V = r_πを解く．返り値は行列ベクトル積の回数で，計算した行の数をbackupsに足す*/
+/*制約違反（-DBL_MAX）の絡む状態は線形でないので除き，後の方策評価のスイープで求める*/
+unsigned long long evaluate_bicgstab(State *state, Policy *pi, unsigned long long *layer, Trans *p, double gamma, unsigned long long *backups)
+{
+    unsigned long long i, e, iter, count;
+    unsigned long long n = layer[Tmax]; //終端時刻以外の状態数
+    unsigned short *lin; //線形に扱える状態か
+    int changed;
+    double *x, *r, *r0, *pp, *v, *s, *tt;
+    double rho, rho_new, alpha, omega, tmp, res;
+
+    lin = (unsigned short *)malloc(sizeof(unsigned short) * (n + 1));
+    x = (double *)malloc(sizeof(double) * 7 * (n + 1));
+    if (lin == NULL || x == NULL) {
+        puts("メモリ不足16.0");
+        exit(EXIT_FAILURE);
+    }
+    r = x + (n + 1);
+    r0 = r + (n + 1);
+    pp = r0 + (n + 1);
+    v = pp + (n + 1);
+    s = v + (n + 1);
+    tt = s + (n + 1);
+
+    /*即時報酬が-DBL_MAXの状態と，そこへ遷移しうる状態を除く*/
+    for (i = 0; i < n; i++) {
+        lin[i] = (pi[i].action.r > -DBL_MAX / 2);
+    }
+    do {
+        changed = 0;
+        for (i = 0; i < n; i++) {
+            if (!lin[i]) {
+                continue;
+            }
+            for (e = p->offset[pi[i].actionnum]; e < p->offset[pi[i].actionnum + 1]; e++) {
+                if (p->statenum[e] < n && !lin[p->statenum[e]]) {
+                    lin[i] = 0;
+                    changed = 1;
+                    break;
+                }
+            }
+        }
+    } while (changed);
+
+    /*初期値は現在の状態価値関数（前の方策で制約違反だった状態は0）*/
+    for (i = 0; i < n; i++) {
+        x[i] = (lin[i] && state[i].V > -DBL_MAX / 2) ? state[i].V : 0;
+    }
+    *backups += policy_matvec(pi, n, lin, p, gamma, x, v);
+    count = 1;
+    for (i = 0; i < n; i++) {
+        r[i] = (lin[i]) ? pi[i].action.r - v[i] : 0;
+        r0[i] = r[i];
+        pp[i] = 0;
+        v[i] = 0;
+    }
+    rho = alpha = omega = 1;
+
+    for (iter = 0; iter < BICG_MAXITER; iter++) {
+        res = 0;
+        for (i = 0; i < n; i++) {
+            res = (res > fabs(r[i])) ? res : fabs(r[i]);
+        }
+        if (res < MICRO || isnan(res)) {
+            break;
+        }
+
+        rho_new = dot(r0, r, n);
+        if (rho_new == 0) {
+            break; //破綻したら後のスイープに任せる
+        }
+        for (i = 0; i < n; i++) {
+            pp[i] = r[i] + (rho_new / rho) * (alpha / omega) * (pp[i] - omega * v[i]);
+        }
+        *backups += policy_matvec(pi, n, lin, p, gamma, pp, v);
+        tmp = dot(r0, v, n);
+        if (tmp == 0) {
+            break;
+        }
+        alpha = rho_new / tmp;
+        for (i = 0; i < n; i++) {
+            s[i] = r[i] - alpha * v[i];
+        }
+        *backups += policy_matvec(pi, n, lin, p, gamma, s, tt);
+        count += 2;
+        tmp = dot(tt, tt, n);
+        omega = (tmp > 0) ? dot(tt, s, n) / tmp : 0;
+        for (i = 0; i < n; i++) {
+            x[i] += alpha * pp[i] + omega * s[i];
+            r[i] = s[i] - omega * tt[i];
+        }
+        if (omega == 0) {
+            break;
+        }
+        rho = rho_new;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (lin[i] && isfinite(x[i])) { //破綻した場合はスイープに任せる
+            state[i].V = x[i];
+        }
+    }
+
+    free(lin);
+    free(x);
+
+    return count;
+}
+
+/*方策反復法*/
+/*PI_SWEEPSを指定すると修正方策反復法になる（方策が変わらず，かつ方策評価が収束したら終了）．PI_SOLVERが2なら方策評価は1回の後ろ向き計算*/
+void policy_iteration(State *state, Policy *pi, unsigned long long n1, unsigned long long *layer, Action *action, unsigned long long n2, Trans *p, double gamma, char *checkpoint, unsigned long long model, char *out_telemetry)
+{
+    unsigned long long i, j, k, e;
+    double delta;
+    int stable;
+    long long changes; //方策が変わった状態数
+    double gap; //方策改善での，最良の行動と今の方策との価値の差の最大値
+    unsigned long long backups; //この回の方策評価・方策改善で更新した状態（行）の数
+    Telemetry tm;
+    unsigned long long b;
+    double max;
+    unsigned long long argmax;
+    double objective;
+    unsigned count, count2;
+    unsigned long long sweeps, matvecs, done, done2;
+    unsigned resume2; //チェックポイントから再開する方策評価の，済んでいるスイープ数
+    time_t last; //最後にチェックポイントを書き出した時刻
+
+    /*初期化*/
+    for (i = 0; i < n1; i++) {
+        pi[i].state = state[i]; //これは固定
+
+        if (i >= layer[Tmax]) {
+            state[i].V = 0; //終端状態の状態価値関数は0
+        } else {
+            state[i].V = V_INITIAL;
+
+            j = state[i].firstaction + state[i].numaction - 1; //その状態の最後の行動で初期化
+            pi[i].action = action[j];
+            pi[i].actionnum = j;
+        }
+    }
+
+    count = 0;
+    resume2 = 0;
+    if (RESUME && load_checkpoint(checkpoint, state, pi, n1, layer, action, gamma, &done, &done2, model)) {
+        count = (done2 > 0) ? done - 1 : done; //方策評価の途中ならその回をやり直さずに続ける
+        resume2 = done2;
+    }
+    last = time(NULL);
+    sweeps = 0;
+    matvecs = 0;
+    open_telemetry(&tm, out_telemetry, "policy_iteration");
+    while (1) {
+        count++;
+        if (count % 10000 == 0) {
+            printf("方策反復法繰り返し処理%u回目\n", count);
+        }
+        
+        /*方策評価*/
+        backups = 0;
+        if (PI_SOLVER == 2) {
+            evaluate_dag(state, pi, layer, p, gamma, &backups);
+            sweeps++;
+            delta = 0; //厳密に求まっている
+        } else {
+            if (PI_SOLVER == 1 && resume2 == 0) {
+                matvecs += evaluate_bicgstab(state, pi, layer, p, gamma, &backups);
+            }
+
+            count2 = resume2;
+            resume2 = 0;
+            delta = DBL_MAX; //方策ごとに評価し直す
+            while (delta >= MICRO && (PI_SWEEPS == 0 || count2 < PI_SWEEPS)) {
+                count2++;
+                sweeps++;
+                if (count2 % 10000 == 0) {
+                    printf("方策評価%u-%u：", count, count2);
+                }
+            
+                delta = evaluation_sweep(state, pi, layer, p, gamma, &backups);
+            
+                if (count2 % 10000 == 0) {
+                    printf("delta = %f\n", delta);
+                }
+
+                if (delta >= MICRO && checkpoint_due(&last)) {
+                    save_checkpoint(checkpoint, state, pi, n1, layer, gamma, count, count2, model); //方策評価の途中
+                }
+            }
+        }
+
+        /*方策改善*/
+        stable = 1;
+        changes = 0;
+        gap = 0;
+        for (i = 0; i < layer[Tmax]; i++) { //終端時刻以外の状態
+            b = pi[i].actionnum;
+            backups++;
+
+            max = -DBL_MAX;
+            argmax = -1;
+            for (j = state[i].firstaction; j < state[i].firstaction + state[i].numaction; j++) { //状態iの行動のみ
+                objective = action[j].r;
+                for (e = p->offset[j]; e < p->offset[j + 1]; e++) {
+                    k = p->statenum[e];
+                    if (state[k].V < -DBL_MAX / 2) {
+                        objective += p->prob[e] * state[k].V;
+                    } else {
+                        objective += p->prob[e] * gamma * state[k].V;
+                    }
+                }
+
+                if (objective > max) {
+                    max = objective;
+                    argmax = j;
+                }
+            }
+            if (argmax == -1) {
+                //puts("方策改善：行き止まりの状態があります．");
+                continue;
+            }
+            if (max > -DBL_MAX / 2 && state[i].V > -DBL_MAX / 2) { //制約違反の状態は含めない
+                gap = (gap > fabs(max - state[i].V)) ? gap : fabs(max - state[i].V);
+            }
+            pi[i].actionnum = argmax;
+            pi[i].action = action[argmax];
+
+            if (b != pi[i].actionnum) {
+                stable = 0;
+                changes++;
+            }
+        }
+
+        write_telemetry(&tm, count, gap, changes, backups);
+
+        if (stable && delta < MICRO) {
+            break;
+        }
+
+        if (checkpoint_due(&last)) {
+            save_checkpoint(checkpoint, state, pi, n1, layer, gamma, count, 0, model);
+        }
+    }
+
+    close_telemetry(&tm);
+
+    printf("方策反復法：方策改善%u回，方策評価のスイープ%llu回，行列ベクトル積%llu回\n", count, sweeps, matvecs);
+}
+
+/*状態iのベルマン更新（行動ごとの即時報酬＋遷移先の状態価値の期待値の最大値）．最大となる行動の配列番号をargmaxに格納する（行動がなければ-1）*/
+double bellman_backup(State *state, unsigned long long i, Action *action, Trans *p, double gamma, unsigned long long *argmax)
+{
+    unsigned long long j, k, e;
+    double max, objective;
+
+    max = -DBL_MAX;
+    *argmax = -1;
+    for (j = state[i].firstaction; j < state[i].firstaction + state[i].numaction; j++) { //状態iの行動のみ
+        objective = action[j].r;
+        for (e = p->offset[j]; e < p->offset[j + 1]; e++) {
+            k = p->statenum[e];
+            if (state[k].V < -DBL_MAX / 2) {
+                objective += p->prob[e] * state[k].V;
+            } else {
+                objective += p->prob[e] * gamma * state[k].V;
             }
         }
-//        putchar('\n'); //追加
+
+        if (objective > max) {
+            max = objective;
+            *argmax = j;
+        }
     }
-    
-//    for (i = 0; i < n1; i++) {
-//        if (state[i].t == 3) {
-//            printf("pi[%llu].action.nowstate.t = %u\n", i, pi[i].action.nowstate.t); //追加
-//        }
-//    }
-    
-    return;
+
+    return max;
 }
 
-/*方策反復法*/
-void policy_iteration(State *state, Policy *pi, unsigned long long n1, Action *action, unsigned long long n2, double *p, double gamma)
+/*ベルマン残差（制約違反の状態同士の差は0とする）*/
+double bellman_residual(double v1, double v2)
 {
-    unsigned long long i, j, k;
-    int tmp_v;
-    double delta = DBL_MAX;
-    int stable;
-    unsigned long long b;
-    double max;
-    unsigned long long argmax;
-    double objective;
-    unsigned count, count2;
+    if (v1 < -DBL_MAX / 2 && v2 < -DBL_MAX / 2) {
+        return 0;
+    }
 
-    /*初期化*/
-    for (i = 0; i < n1; i++) {
-        pi[i].state = state[i]; //これは固定
+    return fabs(v1 - v2);
+}
 
-        if (state[i].t == Tmax) {
-            state[i].V = 0; //終端状態の状態価値関数は0
-        } else {
-            state[i].V = V_INITIAL;
+/*ヒープ内の位置kの要素を親と比較して上に移動する*/
+void heap_up(Heap *h, unsigned long long k)
+{
+    unsigned long long node = h->node[k];
 
-            for (j = 0; j < n2; j++) {
-                if (pi[i].state.id == action[j].nowstate.id) {
-                    pi[i].action = action[j]; //1番最初の行動で初期化
-                    pi[i].actionnum = j;
-                }
-            }
+    while (k > 0 && h->key[h->node[(k - 1) / 2]] < h->key[node]) {
+        h->node[k] = h->node[(k - 1) / 2];
+        h->pos[h->node[k]] = k;
+        k = (k - 1) / 2;
+    }
+    h->node[k] = node;
+    h->pos[node] = k;
+
+    return;
+}
+
+/*ヒープ内の位置kの要素を子と比較して下に移動する*/
+void heap_down(Heap *h, unsigned long long k)
+{
+    unsigned long long c;
+    unsigned long long node = h->node[k];
+
+    while ((c = 2 * k + 1) < h->size) {
+        if (c + 1 < h->size && h->key[h->node[c + 1]] > h->key[h->node[c]]) {
+            c++;
         }
+        if (h->key[h->node[c]] <= h->key[node]) {
+            break;
+        }
+        h->node[k] = h->node[c];
+        h->pos[h->node[k]] = k;
+        k = c;
     }
+    h->node[k] = node;
+    h->pos[node] = k;
 
-    count = 0;
-    while (1) {
-        count++;
-        if (count % 10000 == 0) {
-            printf("方策反復法繰り返し処理%u回目\n", count);
+    return;
+}
+
+/*状態iの優先度をkeyにする（ヒープになければ追加，key < MICROならヒープから除く）*/
+void heap_update(Heap *h, unsigned long long i, double key)
+{
+    unsigned long long k, node;
+
+    if (h->pos[i] == ULLONG_MAX) {
+        if (key < MICRO) {
+            return;
         }
-        
-        /*方策評価*/
-        count2 = 0;
-        while (delta >= MICRO) {
-            count2++;
-            if (count2 % 10000 == 0) {
-                printf("方策評価%u-%u：", count, count2);
-            }
-            
-            delta = 0;
-            for (i = 0; i < n1; i++) {
-                if (state[i].t != Tmax) {
-                    tmp_v = state[i].V;
+        h->key[i] = key;
+        h->node[h->size] = i;
+        h->pos[i] = h->size;
+        h->size++;
+        heap_up(h, h->size - 1);
+    } else if (key < MICRO) {
+        k = h->pos[i];
+        h->pos[i] = ULLONG_MAX;
+        h->size--;
+        if (k < h->size) { //最後の要素を空いた位置に移す
+            node = h->node[h->size];
+            h->node[k] = node;
+            h->pos[node] = k;
+            heap_up(h, k);
+            heap_down(h, h->pos[node]);
+        }
+    } else {
+        h->key[i] = key;
+        heap_up(h, h->pos[i]);
+        heap_down(h, h->pos[i]);
+    }
 
-                    state[i].V = pi[i].action.r;
-                    for (j = 0; j < n1; j++) {
-                        if (state[j].V < -DBL_MAX / 2) {
-                            state[i].V += p[n1 * pi[i].actionnum + j] * state[j].V; //こうすることで近視眼的に行動するときでも制約条件がかかる
-                        } else {
-                            state[i].V += p[n1 * pi[i].actionnum + j] * gamma * state[j].V;
-                        }
-                    }
+    return;
+}
 
-                    delta = (delta > fabs(tmp_v - state[i].V)) ? delta : fabs(tmp_v - state[i].V);
+/*優先度付きスイープ．ベルマン残差の大きい状態から更新し，その状態に遷移しうる状態の残差だけを計算し直す*/
+/*全ての状態の残差がMICRO未満になったら終了（通常の価値反復法と同じ収束判定）*/
+/*countは再開時のそれまでの更新回数*/
+unsigned long long prioritized_sweeping(State *state, unsigned long long n1, unsigned long long *layer, Action *action, Trans *p, double gamma, char *checkpoint, unsigned long long model, unsigned long long count, Telemetry *tm)
+{
+    unsigned long long i, j, k, e, q;
+    unsigned long long argmax;
+    unsigned long long *pred_offset, *pred, *mark;
+    Heap h;
+    time_t last = time(NULL); //最後にチェックポイントを書き出した時刻
+    unsigned long long backups = 0; //前回経過を書き出してからのベルマン更新の計算回数
+
+    /*状態ごとの遷移元の状態（CSR形式・重複なし）*/
+    pred_offset = (unsigned long long *)calloc(n1 + 1, sizeof(unsigned long long));
+    mark = (unsigned long long *)malloc(sizeof(unsigned long long) * n1);
+    if (pred_offset == NULL || mark == NULL) {
+        puts("メモリ不足15.0");
+        exit(EXIT_FAILURE);
+    }
+    for (k = 0; k < n1; k++) {
+        mark[k] = ULLONG_MAX;
+    }
+    for (i = 0; i < layer[Tmax]; i++) {
+        for (j = state[i].firstaction; j < state[i].firstaction + state[i].numaction; j++) {
+            for (e = p->offset[j]; e < p->offset[j + 1]; e++) {
+                k = p->statenum[e];
+                if (mark[k] != i) {
+                    mark[k] = i;
+                    pred_offset[k + 1]++;
                 }
             }
-            
-            if (count2 % 10000 == 0) {
-                printf("delta = %f\n", delta);
+        }
+    }
+    for (k = 0; k < n1; k++) {
+        pred_offset[k + 1] += pred_offset[k];
+        mark[k] = ULLONG_MAX;
+    }
+    pred = (unsigned long long *)malloc(sizeof(unsigned long long) * (pred_offset[n1] + 1));
+    if (pred == NULL) {
+        puts("メモリ不足15.1");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < layer[Tmax]; i++) {
+        for (j = state[i].firstaction; j < state[i].firstaction + state[i].numaction; j++) {
+            for (e = p->offset[j]; e < p->offset[j + 1]; e++) {
+                k = p->statenum[e];
+                if (mark[k] != i) {
+                    mark[k] = i;
+                    pred[pred_offset[k]++] = i;
+                }
             }
         }
+    }
+    for (k = n1; k > 0; k--) { //開始位置を戻す
+        pred_offset[k] = pred_offset[k - 1];
+    }
+    pred_offset[0] = 0;
+
+    /*ヒープの作成*/
+    h.node = mark; //作業領域を使い回す
+    h.pos = (unsigned long long *)malloc(sizeof(unsigned long long) * n1);
+    h.key = (double *)malloc(sizeof(double) * n1);
+    if (h.pos == NULL || h.key == NULL) {
+        puts("メモリ不足15.2");
+        exit(EXIT_FAILURE);
+    }
+    h.size = 0;
+    for (i = 0; i < n1; i++) {
+        h.pos[i] = ULLONG_MAX;
+    }
+    for (i = 0; i < layer[Tmax]; i++) { //終端時刻以外の状態
+        heap_update(&h, i, bellman_residual(state[i].V, bellman_backup(state, i, action, p, gamma, &argmax)));
+    }
 
-        /*方策改善*/
-        stable = 1;
-        for (i = 0; i < n1; i++) {
-            if (state[i].t != Tmax) {
-                b = pi[i].actionnum;
-
-                max = -DBL_MAX;
-                argmax = -1;
-                for (j = 0; j < n2; j++) {
-                    if (action[j].nowstate.id == state[i].id) {
-                        objective = action[j].r;
-                        for (k = 0; k < n1; k++) {
-                            if (state[k].V < -DBL_MAX / 2) {
-                                objective += p[n1 * j + k] * state[k].V;
-                            } else {
-                                objective += p[n1 * j + k] * gamma * state[k].V;
-                            }
-                        }
-
-                        if (objective > max) {
-                            max = objective;
-                            argmax = j;
-                        }
-                    }
-                }
-                if (argmax == -1) {
-                    //puts("方策改善：行き止まりの状態があります．");
-                    continue;
-                }
-                pi[i].actionnum = argmax;
-                pi[i].action = action[argmax];
+    /*残差の大きい状態から更新*/
+    while (h.size > 0) {
+        i = h.node[0];
+        heap_update(&h, i, 0); //取り出し
+        state[i].V = bellman_backup(state, i, action, p, gamma, &argmax);
+        count++;
+        backups += 1 + pred_offset[i + 1] - pred_offset[i];
 
-                if (b != pi[i].actionnum) {
-                    stable = 0;
-                }
-            }
+        for (e = pred_offset[i]; e < pred_offset[i + 1]; e++) {
+            q = pred[e];
+            heap_update(&h, q, bellman_residual(state[q].V, bellman_backup(state, q, action, p, gamma, &argmax)));
         }
 
-        if (stable) {
-            break;
+        if (count % 65536 == 0) { //経過の書き出しと時刻の確認は間引く
+            write_telemetry(tm, count, (h.size > 0) ? h.key[h.node[0]] : 0, -1, backups);
+            backups = 0;
+            if (checkpoint_due(&last)) {
+                save_checkpoint(checkpoint, state, NULL, n1, layer, gamma, count, 0, model);
+            }
         }
     }
+    if (backups > 0) {
+        write_telemetry(tm, count, 0, -1, backups);
+    }
+
+    free(pred_offset);
+    free(pred);
+    free(h.node);
+    free(h.pos);
+    free(h.key);
+
+    return count;
 }
 
 /*価値反復法*/
-void value_iteration(State *state, Policy *pi, unsigned long long n1, Action *action, unsigned long long n2, double *p, double gamma)
+void value_iteration(State *state, Policy *pi, unsigned long long n1, unsigned long long *layer, Action *action, unsigned long long n2, Trans *p, double gamma, char *checkpoint, unsigned long long model, char *out_telemetry)
 {
-    unsigned long long i, j, k;
+    unsigned long long i, j, k, e;
     double delta = DBL_MAX;
     double tmp_v;
-    double max, max2;
-    double objective, objective2;
+    double max2;
+    double objective2;
     unsigned long long argmax;
-    unsigned count;
+    unsigned long long count;
+    unsigned long long done; //方策評価の途中の回数（価値反復法では0）
+    unsigned t;
+    time_t last; //最後にチェックポイントを書き出した時刻
+    Telemetry tm;
 
     for (i = 0; i < n1; i++) {
         state[i].V = 0;
@@ -2025,76 +3643,78 @@ void value_iteration(State *state, Policy *pi, unsigned long long n1, Action *ac
     }
 
     count = 0;
-    while (delta >= MICRO) {
-        count++;
-        if (count % 10000 == 0) {
-            printf("価値反復法繰り返し処理%u回目：", count);
-        }
-        
-        delta = 0;
+    if (RESUME) {
+        load_checkpoint(checkpoint, state, NULL, n1, layer, action, gamma, &count, &done, model);
+    }
+    last = time(NULL);
+    open_telemetry(&tm, out_telemetry, (VI_MODE == 2) ? "prioritized_sweeping" : (VI_MODE == 1) ? "value_iteration_gs" : "value_iteration");
 
-        for (i = 0; i < n1; i++) {
-            if (state[i].t != Tmax) {
-                tmp_v = state[i].V;
-
-                max = -DBL_MAX;
-                for (j = 0; j < n2; j++) {
-                    if (action[j].nowstate.id == state[i].id) {
-                        objective = action[j].r;
-                        for (k = 0; k < n1; k++) {
-                            if (state[k].V < -DBL_MAX / 2) {
-                                objective +=  p[n1 * j + k] * state[k].V;
-                            } else {
-                                objective +=  p[n1 * j + k] * gamma * state[k].V;
-                            }
-                        }
+    if (VI_MODE == 2) {
+        count = prioritized_sweeping(state, n1, layer, action, p, gamma, checkpoint, model, count, &tm);
+        printf("価値反復法（優先度付きスイープ）：ベルマン更新%llu回\n", count);
+    } else {
+        while (delta >= MICRO) {
+            count++;
+            if (count % 10000 == 0) {
+                printf("価値反復法繰り返し処理%llu回目：", count);
+            }
+            
+            delta = 0;
 
-                        if (objective > max) {
-                            max = objective;
-                        }
+            if (VI_MODE == 1) {
+                /*遷移先の時刻から順に更新するので，更新した値がその回のうちに使われる*/
+                for (t = Tmax; t-- > 0;) {
+                    for (i = layer[t]; i < layer[t + 1]; i++) {
+                        tmp_v = state[i].V;
+                        state[i].V = bellman_backup(state, i, action, p, gamma, &argmax);
+                        delta = (delta > bellman_residual(tmp_v, state[i].V)) ? delta : bellman_residual(tmp_v, state[i].V);
                     }
                 }
-                state[i].V = max;
+            } else {
+                for (i = 0; i < layer[Tmax]; i++) { //終端時刻以外の状態
+                    tmp_v = state[i].V;
+                    state[i].V = bellman_backup(state, i, action, p, gamma, &argmax);
+                    delta = (delta > bellman_residual(tmp_v, state[i].V)) ? delta : bellman_residual(tmp_v, state[i].V);
+                }
+            }
+            if (count % 10000 == 0) {
+                printf("delta = %f\n", delta);
+            }
+            write_telemetry(&tm, count, delta, -1, layer[Tmax]);
 
-                delta = (delta > fabs(tmp_v - state[i].V)) ? delta : fabs(tmp_v - state[i].V);
+            if (checkpoint_due(&last)) {
+                save_checkpoint(checkpoint, state, NULL, n1, layer, gamma, count, 0, model);
             }
         }
-        if (count % 10000 == 0) {
-            printf("delta = %f\n", delta);
-        }
+        printf("価値反復法：繰り返し処理%llu回\n", count);
     }
-
-    for (i = 0; i < n1; i++) {
-        if (state[i].t != Tmax) {
-            max2 = -DBL_MAX;
-            argmax = -1;
-            for (j = 0; j < n2; j++) {
-                if (action[j].nowstate.id == state[i].id) {
-                    objective2 = action[j].r;
-                    for (k = 0; k < n1; k++) {
-                        if (state[k].V < -DBL_MAX / 2) {
-                            objective2 += p[n1 * j + k] * state[k].V;
-                        } else {
-                            objective2 += p[n1 * j + k] * gamma * state[k].V;
-                        }
-                    }
-
-                    if (objective2 > max2) {
-                        max2 = objective2;
-                        argmax = j;
-                    }
-                }
-            }
-            if (argmax == -1) {
-                //puts("価値反復：行き止まりの状態があります．");
-                for (j = 0; j < n2; j++) {
-                    if (state[i].id == action[j].nowstate.id) {
-                        pi[i].actionnum = j;
-                        pi[i].action = action[j];
-                    }
+    close_telemetry(&tm);
+
+    for (i = 0; i < layer[Tmax]; i++) { //終端時刻以外の状態
+        max2 = -DBL_MAX;
+        argmax = -1;
+        for (j = state[i].firstaction; j < state[i].firstaction + state[i].numaction; j++) { //状態iの行動のみ
+            objective2 = action[j].r;
+            for (e = p->offset[j]; e < p->offset[j + 1]; e++) {
+                k = p->statenum[e];
+                if (state[k].V < -DBL_MAX / 2) {
+                    objective2 += p->prob[e] * state[k].V;
+                } else {
+                    objective2 += p->prob[e] * gamma * state[k].V;
                 }
             }
 
+            if (objective2 > max2) {
+                max2 = objective2;
+                argmax = j;
+            }
+        }
+        if (argmax == -1) {
+            //puts("価値反復：行き止まりの状態があります．");
+            j = state[i].firstaction + state[i].numaction - 1;
+            pi[i].actionnum = j;
+            pi[i].action = action[j];
+        } else {
             pi[i].actionnum = argmax;
             pi[i].action = action[argmax];
         }
@@ -2142,33 +3762,108 @@ void value_iteration(State *state, Policy *pi, unsigned long long n1, Action *ac
 
 
 /*確率に従ってランダムに次の状態を返す関数*/
-unsigned long long nextstate(unsigned long long actionnum, double *p, unsigned long long n) { //nはstateの数
-    unsigned long long i;
+unsigned long long nextstate(unsigned long long actionnum, Trans *p) {
+    unsigned long long e;
     double random;
 
     random = (double)rand() / RAND_MAX;
 
-    for (i = 0; i < n; i++) {
-        random -= p[n * actionnum + i];
+    for (e = p->offset[actionnum]; e < p->offset[actionnum + 1]; e++) {
+        random -= p->prob[e];
         if (random <= 0) {
-            return i;
+            return p->statenum[e];
         }
     }
-    
-//    for (i = n - 1; i >= 0; i--) {
-//        if (p[n * actionnum + i] > 0.0000) {
-//            return i;
-//        }
-//    }
+    if (p->offset[actionnum] < p->offset[actionnum + 1]) {
+        return p->statenum[p->offset[actionnum + 1] - 1]; //単精度では行の和が1をわずかに下回ることがあるので，余りは最後の遷移先に割り当てる
+    }
 
     puts("statenumが見つかりませんでした．");
     exit(EXIT_FAILURE);
 }
 
+/*倍精度での結果（状態価値関数と最適行動の配列番号）を単精度の検証用に書き出す*/
+void write_reference(State *state, Policy *pi, unsigned long long n1, unsigned long long *layer, char *out_reference)
+{
+    unsigned long long i;
+    FILE *fp;
+
+    fp = fopen(out_reference, "w");
+    if (fp == NULL) {
+        printf("ファイル%sが開けません．\n", out_reference);
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(fp, "state,V,action\n"); //1行目
+    for (i = 0; i < n1; i++) {
+        fprintf(fp, "%llu,%.17g,%lld\n", i, state[i].V, (i < layer[Tmax]) ? (long long)pi[i].actionnum : -1LL);
+    }
+
+    fclose(fp);
+
+    return;
+}
+
+/*単精度での結果を倍精度での結果と比較し，状態価値関数と最適行動の違いを報告する*/
+void precision_report(State *state, Policy *pi, unsigned long long n1, unsigned long long *layer, char *out_reference)
+{
+    unsigned long long i, count, feasible, policy;
+    long long a;
+    double V, dV, max, max_rel;
+    FILE *fp;
+
+    fp = fopen(out_reference, "r");
+    if (fp == NULL) {
+        printf("ファイル%sがないので，倍精度との比較は行いません．\n", out_reference);
+        return;
+    }
+
+    fscanf(fp, "%*[^\n]\n"); //1行目は読み飛ばす
+
+    count = 0;
+    feasible = 0;
+    policy = 0;
+    max = 0;
+    max_rel = 0;
+    while (fscanf(fp, "%llu,%lf,%lld", &i, &V, &a) == 3) {
+        if (i >= n1) {
+            puts("倍精度での結果と状態数が一致しません．");
+            fclose(fp);
+            return;
+        }
+        count++;
+
+        if (V < -DBL_MAX / 2 || state[i].V < -DBL_MAX / 2) {
+            if ((V < -DBL_MAX / 2) != (state[i].V < -DBL_MAX / 2)) {
+                feasible++; //制約違反かどうかが変わった
+            }
+        } else {
+            dV = fabs(state[i].V - V);
+            max = (dV > max) ? dV : max;
+            dV /= (fabs(V) > 1) ? fabs(V) : 1;
+            max_rel = (dV > max_rel) ? dV : max_rel;
+        }
+
+        if (i < layer[Tmax] && (long long)pi[i].actionnum != a) {
+            policy++;
+        }
+    }
+    fclose(fp);
+
+    if (count != n1) {
+        puts("倍精度での結果と状態数が一致しません．");
+        return;
+    }
+
+    printf("倍精度との比較：最大誤差%e，最大相対誤差%e，制約違反の判定の相違%llu状態，最適行動の相違%llu/%llu状態\n", max, max_rel, feasible, policy, layer[Tmax]);
+
+    return;
+}
+
 /*確率に従ってランダムに最初の状態を返す関数*/
-unsigned long long firststate(double *first_p, unsigned long long n1, State *state, unsigned long long n2)
+unsigned long long firststate(double *first_p, unsigned long long n1, unsigned long long *layer)
 {
-    unsigned long long i, j, count;
+    unsigned long long i;
     double random;
 
     random = (double)rand() / RAND_MAX;
@@ -2179,36 +3874,18 @@ unsigned long long firststate(double *first_p, unsigned long long n1, State *sta
     for (i = 0; i < n1; i++) {
         random -= first_p[i];
         if (random <= 0) {
-            count = 0;
-            for (j = 0; j < n2; j++) {
-                if (state[j].t == 0) {
-                    if (count == i) {
-                        return j;
-                    }
-                    count++;
-                }
-            }
+            return layer[0] + i; //first_pはt=0の状態の並び順
         }
     }
 
     puts("初期状態が見つかりませんでした．");
     exit(EXIT_FAILURE);
-    
-//    for (j = n2 - 1; j >= 0; j--) {
-//        if (state[j].t == 0) {
-//            return j;
-//        }
-//    }
-//
-//    puts("初期状態が見つかりませんでした．");
-//    exit(EXIT_FAILURE);
 }
 
 /*シミュレーション*/
-double simulation(Policy *pi, Action *actionlist, State *statelist, State *state, unsigned long long n4, Demand *demand, int n5, Network *link2, int n6, Network *link, int n7, double *P, char *out_simulation, double *p, Action *action, unsigned long long n8, double *first_p, unsigned long long n9)
+double simulation(Policy *pi, Action *actionlist, State *statelist, State *state, unsigned long long n4, Demand *demand, int n5, Network *link2, int n6, Network *link, int n7, double *P, char *out_simulation, Trans *p, Action *action, unsigned long long n8, double *first_p, unsigned long long n9, unsigned long long *layer)
 {
     int t;
-    unsigned long long i;
     int j, k;
     unsigned long long statenum, actionnum;
 //    unsigned short sf[n5];
@@ -2218,28 +3895,28 @@ double simulation(Policy *pi, Action *actionlist, State *statelist, State *state
     
     /*初期状態を作成*/
     t = 0;
-    statenum = firststate(first_p, n9, state, n4);
+    statenum = firststate(first_p, n9, layer);
     statelist[t] = state[statenum];
     G = 0.0;
 
     /*繰り返し処理*/
     while (t != Tmax) {
         actionlist[t] = pi[statenum].action; //行動を決定
-        G += pi[statenum].action.r; //収益に追加
+        actionnum = pi[statenum].actionnum; //行動の配列番号（行動の配列を探さずに済む）
         
-        actionnum = -1;
-        for (i = 0; i < n8; i++) {
-            if (actionlist[t].id == action[i].id) {
-                actionnum = i;
+        /*全ての行動が制約違反の状態では遷移先がないので，その状態に留まったまま打ち切る*/
+        /*収益には制約違反の即時報酬（-DBL_MAX）を加え，その試行が実行不可能だったことが分かるようにする*/
+        if (p->offset[actionnum] == p->offset[actionnum + 1]) {
+            G += pi[statenum].action.r;
+            for (t++; t <= Tmax; t++) {
+                statelist[t] = state[statenum];
             }
-        }
-        if (actionnum == -1) {
-            puts("actionnumが見つかりませんでした．");
-            exit(EXIT_FAILURE);
+            break;
         }
         
+        G += pi[statenum].action.r; //収益に追加
         t++;
-        statenum = nextstate(actionnum, p, n4);
+        statenum = nextstate(actionnum, p);
         statelist[t] = state[statenum];
         //grl_assignment(link2, n6, demand, n5, link, n7, actionlist[t - 1], P, d, Q, link3, pr);
         //for (k = 0; k < n5; k++) {
@@ -2308,16 +3985,16 @@ double simulation(Policy *pi, Action *actionlist, State *statelist, State *state
         for (t = 0; t <= Tmax; t++) {
             fprintf(fp, "%u,", statelist[t].t);
             for (j = 0; j < VNUMBER - 1; j++) {
-                fprintf(fp, "%d,", statelist[t].vs[j].link.id);
+                fprintf(fp, "%d,", link[get_link(&statelist[t], j)].id);
                 for (k = 0; k < n5; k++) {
-                    fprintf(fp, "%u,", statelist[t].vs[j].sf[k]);
+                    fprintf(fp, "%u,", get_sf(&statelist[t], j, k));
                 }
             }
-            fprintf(fp, "%d,", statelist[t].vs[VNUMBER - 1].link.id);
+            fprintf(fp, "%d,", link[get_link(&statelist[t], VNUMBER - 1)].id);
             for (k = 0; k < n5 - 1; k++) {
-                fprintf(fp, "%u,", statelist[t].vs[VNUMBER - 1].sf[k]);
+                fprintf(fp, "%u,", get_sf(&statelist[t], VNUMBER - 1, k));
             }
-            fprintf(fp, "%u\n", statelist[t].vs[VNUMBER - 1].sf[n5 - 1]);
+            fprintf(fp, "%u\n", get_sf(&statelist[t], VNUMBER - 1, n5 - 1));
         }
         fclose(fp);
     }
@@ -2365,6 +4042,22 @@ int main(void)
         "/home/suzuki/graduation_thesis/numerical_results/14/revenue_14_test3_0.5.csv",
         "/Users/taikisuzuki/Desktop/graduation_thesis/numerical_results/18/revenue_18_1_30.csv"
     };
+    char *out_reference[] = {
+        "/Users/taikisuzuki/Desktop/graduation_thesis/numerical_results/18/reference_18_1_30_0.csv",
+        "/Users/taikisuzuki/Desktop/graduation_thesis/numerical_results/18/reference_18_1_30_0.5.csv",
+        "/Users/taikisuzuki/Desktop/graduation_thesis/numerical_results/18/reference_18_1_30_1.csv"
+    };
+    char *out_telemetry[] = { //方策反復・価値反復の経過
+        "/Users/taikisuzuki/Desktop/graduation_thesis/numerical_results/18/telemetry_18_1_30_0.csv",
+        "/Users/taikisuzuki/Desktop/graduation_thesis/numerical_results/18/telemetry_18_1_30_0.5.csv",
+        "/Users/taikisuzuki/Desktop/graduation_thesis/numerical_results/18/telemetry_18_1_30_1.csv"
+    };
+    char *checkpoint_trans = "/Users/taikisuzuki/Desktop/graduation_thesis/numerical_results/18/trans_18_1_30.bin"; //状態遷移確率のチェックポイント
+    char *checkpoint[] = { //方策反復・価値反復のチェックポイント
+        "/Users/taikisuzuki/Desktop/graduation_thesis/numerical_results/18/checkpoint_18_1_30_0.bin",
+        "/Users/taikisuzuki/Desktop/graduation_thesis/numerical_results/18/checkpoint_18_1_30_0.5.bin",
+        "/Users/taikisuzuki/Desktop/graduation_thesis/numerical_results/18/checkpoint_18_1_30_1.bin"
+    };
 
     /*デマンド交通のネットワークデータ仮格納用*/
     Network *linklist = NULL;
@@ -2381,6 +4074,18 @@ int main(void)
     /*OD表格納用（リンク数は変数なので，動的配列を使う）*/
     Demand *demand;
 
+    /*デマンド交通のリンクの接続関係*/
+    Adjacency adj = {NULL, NULL, NULL, 0, 0};
+
+    /*デマンド交通のリンク間の最小所要時間*/
+    int *hop;
+
+    /*gRLの作業領域（スレッドごと）*/
+    Grl_Work *work;
+
+    /*gRLの需要側ネットワーク（需要ごとの前計算）*/
+    Grl_Net net;
+
     /*状態数*/
     unsigned long long number_of_states;
 
@@ -2395,6 +4100,7 @@ int main(void)
 
     /*需要側リンク数カウント用*/
     int number_of_links2;
+    unsigned long long model; //チェックポイントの照合用の入力データのハッシュ
 
     /*需要側のネットワークデータ仮格納用*/
     Network *linklist2 = NULL;
@@ -2406,13 +4112,15 @@ int main(void)
     double *P;
 
     /*状態遷移確率*/
-    double *p;
+    Trans p;
     
     /*時間割引率*/
-    double gamma[] = {gamma_a, gamma_b, gamma_c};
+    double gamma[GAMMAS] = {gamma_a, gamma_b, gamma_c};
 
     /*最適方策*/
     Policy *pi;
+    double *Vg; //ケースごとの状態価値関数（まとめて計算する場合）
+    unsigned long long *actg; //ケースごとの最適行動の配列番号（まとめて計算する場合）
 
     /*行動列（シミュレーション）*/
     Action *actionlist;
@@ -2425,11 +4133,15 @@ int main(void)
     
     /*初期状態数*/
     unsigned long long number_of_first_states;
+    
+    /*時刻ごとの状態の先頭の配列番号*/
+    unsigned long long layer[Tmax + 2];
 
     unsigned long long i;
     int j, t, k;
     FILE *fp_main;
     double revenue;
+    int dead_end; //遷移先のない状態に到達したシミュレーションの回数
 
     /*--------------------ここから実際の処理--------------------*/
 
@@ -2460,6 +4172,18 @@ int main(void)
 
     /*OD表格納*/
     set_demand(demand, odlist, in_od, number_of_od);
+
+    /*リンク間の最小所要時間の配列の確保*/
+    hop = (int *)malloc(sizeof(int) * number_of_links * number_of_links);
+    if (hop == NULL) {
+        puts("メモリ不足9.1");
+        exit(EXIT_FAILURE);
+    }
+
+    /*リンク間の最小所要時間の計算，需要の出発地・目的地リンクの対応付け*/
+    set_adjacency(&adj, link, number_of_links);
+    set_hop(hop, &adj, number_of_links);
+    set_demand_link(demand, number_of_od, link, number_of_links);
     step2 = clock();
     printf("経過時間：%f[s]\n\n", (double)(step2 - start) / CLOCKS_PER_SEC);
 
@@ -2474,8 +4198,8 @@ int main(void)
     }
 
     /*状態の格納，最終状態数・行動数計算*/
-    set_states(state, number_of_states, demand, number_of_od, link, number_of_links);
-    number_of_actions = how_many_actions(link, number_of_links, state, number_of_states, demand, number_of_od);
+    set_states(state, number_of_states, layer, demand, number_of_od, link, number_of_links);
+    number_of_actions = how_many_actions(link, number_of_links, state, number_of_states, demand, number_of_od, &adj);
     printf("状態と行動との組み合わせ数：%llu\n", number_of_actions);
     step3 = clock();
     printf("経過時間：%f[s]\n\n", (double)(step3 - start) / CLOCKS_PER_SEC);
@@ -2488,7 +4212,7 @@ int main(void)
     }
 
     /*行動の格納*/
-    set_action(action, number_of_actions, link, number_of_links, state, number_of_states, demand, number_of_od);
+    set_action(action, number_of_actions, link, number_of_links, state, number_of_states, demand, number_of_od, hop, &adj);
     step4 = clock();
     printf("経過時間：%f[s]\n\n", (double)(step4 - start) / CLOCKS_PER_SEC);
 
@@ -2504,6 +4228,9 @@ int main(void)
 
     /*需要側のネットワークデータ格納*/
     set_network2(link2, linklist2, in_network2, number_of_links2);
+
+    /*gRLの需要側ネットワークの前計算*/
+    set_grl_net(&net, link2, number_of_links2, demand, number_of_od);
     step5 = clock();
     printf("経過時間：%f[s]\n\n", (double)(step5 - start) / CLOCKS_PER_SEC);
 
@@ -2515,22 +4242,18 @@ int main(void)
         exit(EXIT_FAILURE);
     }
 
-    /*状態遷移確率の配列の確保*/
-    p = (double *)malloc(sizeof(double) * (number_of_states) * (number_of_actions));
+    /*gRLの作業領域の確保（大きさは計算しながら必要な分だけ拡張する）*/
+    work = (Grl_Work *)calloc(use_threads(), sizeof(Grl_Work));
+    if (work == NULL) {
+        puts("メモリ不足13.2");
+        exit(EXIT_FAILURE);
+    }
+
+    /*入札確率の表の作成*/
+    set_bid_table(&net, demand, number_of_od, number_of_links, hop, work);
 
-    /*状態遷移確率の計算*/
-    get_state_trans_prob(link2, number_of_links2, demand, number_of_od, link, number_of_links, state, number_of_states, action, number_of_actions, p, P);
-    puts("状態遷移確率計算完了");
-    step6 = clock();
-    printf("経過時間：%f[s]\n\n", (double)(step6 - start) / CLOCKS_PER_SEC);
-    
     /*first_pのメモリ確保*/
-    number_of_first_states = 0;
-    for (i = 0; i < number_of_states; i++) {
-        if (state[i].t == 0) {
-            number_of_first_states++;
-        }
-    }
+    number_of_first_states = layer[1] - layer[0];
     first_p = (double *)malloc(sizeof(double) * number_of_first_states);
     if (first_p == NULL) {
         puts("first_pのメモリ確保失敗");
@@ -2538,8 +4261,45 @@ int main(void)
     }
     
     /*最初の状態の確率を計算*/
-    first_state_prob(state, number_of_states, first_p, number_of_first_states, link, number_of_links, demand, number_of_od, link2, number_of_links2, P);
+    first_state_prob(state, number_of_states, layer, first_p, number_of_first_states, link, number_of_links, demand, number_of_od, &net, P, hop);
+
+    /*初期状態から到達できない状態と行動を削除*/
+    prune_unreachable(state, &number_of_states, layer, action, &number_of_actions, first_p, &number_of_first_states, demand, number_of_od, link, number_of_links);
+    state = (State *)realloc(state, sizeof(State) * number_of_states);
+    action = (Action *)realloc(action, sizeof(Action) * number_of_actions);
+    if (state == NULL || action == NULL) {
+        puts("メモリ不足13.0");
+        exit(EXIT_FAILURE);
+    }
+
+    /*チェックポイントの照合用に入力データをハッシュする（即時報酬が-DBL_MAXになる前）*/
+    model = model_hash(link, number_of_links, link2, number_of_links2, demand, number_of_od, &net, first_p, number_of_first_states, action, number_of_actions);
+
+    /*状態遷移確率の配列の確保（非ゼロ要素の配列は計算しながら拡張する）*/
+    p.offset = (unsigned long long *)malloc(sizeof(unsigned long long) * (number_of_actions + 1));
+    if (p.offset == NULL) {
+        puts("メモリ不足13.1");
+        exit(EXIT_FAILURE);
+    }
+    p.statenum = NULL;
+    p.prob = NULL;
+    p.nnz = 0;
+    p.size = 0;
+
+    /*状態遷移確率の計算（チェックポイントがあれば読み込む）*/
+    if (RESUME && load_trans(&p, state, action, number_of_states, number_of_actions, checkpoint_trans, model)) {
+        printf("チェックポイント%sから状態遷移確率を読み込みました\n", checkpoint_trans);
+    } else {
+        get_state_trans_prob(&net, demand, number_of_od, link, number_of_links, state, number_of_states, layer, action, number_of_actions, &p, P, hop);
+        if (CHECKPOINT_SEC > 0) {
+            save_trans(&p, state, action, number_of_states, number_of_actions, checkpoint_trans, model);
+        }
+    }
+    puts("状態遷移確率計算完了");
+    step6 = clock();
+    printf("経過時間：%f[s]\n\n", (double)(step6 - start) / CLOCKS_PER_SEC);
 
+    
     /*最適方策の配列の確保*/
     pi = (Policy *)malloc(sizeof(Policy) * number_of_states);
     if (pi == NULL) {
@@ -2568,39 +4328,51 @@ int main(void)
             }
         }
     }
-    for (t = 0; t <= Tmax; t++) {
-        statelist[t].vs = (V_State *)malloc(sizeof(V_State) * VNUMBER);
-        if (statelist[t].vs == NULL) {
-            puts("メモリ確保失敗18");
+    
+    /*全ケースをまとめて最適化*/
+    Vg = NULL;
+    actg = NULL;
+    if (SOLUTION == 0 && FUSED_GAMMA) {
+        Vg = (double *)malloc(sizeof(double) * number_of_states * (CASE_END - CASE_BEGIN));
+        actg = (unsigned long long *)malloc(sizeof(unsigned long long) * number_of_states * (CASE_END - CASE_BEGIN));
+        if (Vg == NULL || actg == NULL) {
+            puts("メモリ不足15.3");
             exit(EXIT_FAILURE);
         }
-        for (j = 0; j < VNUMBER; j++) {
-            statelist[t].vs[j].sf = (unsigned short *)malloc(sizeof(unsigned short) * number_of_od);
-            if (statelist[t].vs[j].sf == NULL) {
-                puts("メモリ確保失敗19");
-                exit(EXIT_FAILURE);
-            }
-        }
+        backward_induction_multi(state, Vg, actg, number_of_states, layer, action, &p, gamma + CASE_BEGIN, CASE_END - CASE_BEGIN);
+        puts("後ろ向き帰納法で全ケースの最適化完了");
+        step7 = clock();
+        printf("経過時間：%f[s]\n\n", (double)(step7 - start) / CLOCKS_PER_SEC);
     }
-    
+
     /*ケースごとの計算*/
-    for (j = 2; j < 3; j++) {
+    for (j = CASE_BEGIN; j < CASE_END; j++) {
         printf("ケース%dの計算開始\n\n", j);
         
         /*最適化*/
-        if (SOLUTION == 0) {
-            backward_induction(state, pi, number_of_states, action, number_of_actions, p, gamma[j]);
+        if (SOLUTION == 0 && FUSED_GAMMA) {
+            restore_case(state, pi, Vg, actg, number_of_states, layer, action, CASE_END - CASE_BEGIN, j - CASE_BEGIN);
+            printf("後ろ向き帰納法（まとめて計算）で");
+        } else if (SOLUTION == 0) {
+            backward_induction(state, pi, number_of_states, layer, action, number_of_actions, &p, gamma[j]);
             printf("後ろ向き帰納法で");
         } else if (SOLUTION == 1) {
-            policy_iteration(state, pi, number_of_states, action, number_of_actions, p, gamma[j]);
+            policy_iteration(state, pi, number_of_states, layer, action, number_of_actions, &p, gamma[j], checkpoint[j], model, out_telemetry[j]);
             printf("方策反復法で");
         } else {
-            value_iteration(state, pi, number_of_states, action, number_of_actions, p, gamma[j]);
+            value_iteration(state, pi, number_of_states, layer, action, number_of_actions, &p, gamma[j], checkpoint[j], model, out_telemetry[j]);
             printf("価値反復法で");
         }
         puts("最適化完了");
         step7 = clock();
         printf("経過時間：%f[s]\n\n", (double)(step7 - start) / CLOCKS_PER_SEC);
+
+        /*単精度の検証*/
+        if (PRECISION_CHECK && FLOAT_PROB) {
+            precision_report(state, pi, number_of_states, layer, out_reference[j]);
+        } else if (PRECISION_CHECK) {
+            write_reference(state, pi, number_of_states, layer, out_reference[j]);
+        }
         
         /*シミュレーション*/
         fp_main = fopen(out_revenue[j], "w");
@@ -2611,13 +4383,20 @@ int main(void)
         
         fprintf(fp_main, "number,revenue\n"); //1行目
         
+        dead_end = 0;
         for (k = 0; k < TRIALS; k++) {
-            revenue = simulation(pi, actionlist, statelist, state, number_of_states, demand, number_of_od, link2, number_of_links2, link, number_of_links, P, out_simulation[j], p, action, number_of_actions, first_p, number_of_first_states);
+            revenue = simulation(pi, actionlist, statelist, state, number_of_states, demand, number_of_od, link2, number_of_links2, link, number_of_links, P, out_simulation[j], &p, action, number_of_actions, first_p, number_of_first_states, layer);
+            if (revenue < -DBL_MAX / 2) {
+                dead_end++;
+            }
             
             fprintf(fp_main, "%d,%f\n", k + 1, revenue);
         }
         
         fclose(fp_main);
+        if (dead_end > 0) {
+            printf("%d回のシミュレーションが遷移先のない状態に到達しました（収益は-DBL_MAXとして書き出し）\n", dead_end);
+        }
         
         printf("ケース%dの計算終了\n\n", j);
         step8 = clock();
@@ -2632,12 +4411,13 @@ int main(void)
 //    free(pr);
     free(link);
     free(demand);
-    for (i = 0; i < number_of_states; i++) {
-        for (j = 0; j < VNUMBER; j++) {
-            free(state[i].vs[j].sf);
-        }
-        free(state[i].vs);
+    free(hop);
+    free_adjacency(&adj);
+    for (j = 0; j < use_threads(); j++) {
+        free_grl_work(&work[j]);
     }
+    free(work);
+    free_grl_net(&net);
     free(state);
     for (i = 0; i < number_of_actions; i++) {
         for (j = 0; j < VNUMBER; j++) {
@@ -2647,9 +4427,13 @@ int main(void)
     }
     free(action);
     free(link2);
-    free(p);
+    free(p.offset);
+    free(p.statenum);
+    free(p.prob);
     free(P);
     free(pi);
+    free(Vg);
+    free(actg);
     free(actionlist);
     free(statelist);
     free(first_p);